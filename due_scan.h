@@ -0,0 +1,113 @@
+#ifndef __due_scan_h
+#define __due_scan_h
+
+/*
+ * Kernels that find the due alarms in a block of deadlines: given
+ * up to DUE_BLOCK deadlines and the current tick, each returns a
+ * mask with bit i set when deadline[i] <= now. In the same pass
+ * each lowers *next to the earliest deadline that is not due, so
+ * the caller learns when to wake next without a second scan (start
+ * *next at LLONG_MAX, which stays if nothing is left). The scalar kernel
+ * works anywhere; on x86 there are SSE4.2 and AVX2 kernels, which
+ * compare two and four 64-bit deadlines per instruction. They are
+ * compiled with per-function target attributes, so the program
+ * needs no -m flags and still runs on older CPUs: due_scan_select
+ * picks the best kernel the running CPU supports.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define DUE_SCAN_X86
+#endif
+
+#define DUE_BLOCK       64
+
+typedef unsigned long long (*due_scan_t) (
+    const long long *deadline, int count, long long now, long long *next);
+
+static inline unsigned long long due_scan_scalar (
+    const long long *deadline, int count, long long now, long long *next)
+{
+    unsigned long long mask = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (deadline[i] <= now)
+            mask |= 1ULL << i;
+        else if (deadline[i] < *next)
+            *next = deadline[i];
+    }
+    return mask;
+}
+
+#ifdef DUE_SCAN_X86
+/*
+ * There is no "less or equal" compare for 64-bit integers, so the
+ * vector kernels take the deadlines that are later than now and
+ * invert. Nor is there a 64-bit min before AVX-512, so each lane
+ * keeps its least later deadline by compare and blend, and the
+ * lanes are folded into *next at the end. The tail that does not
+ * fill a vector goes to the scalar kernel.
+ */
+__attribute__ ((target ("sse4.2")))
+static inline unsigned long long due_scan_sse42 (
+    const long long *deadline, int count, long long now, long long *next)
+{
+    __m128i limit = _mm_set1_epi64x (now), least = _mm_set1_epi64x (*next);
+    unsigned long long mask = 0;
+    long long lane[2];
+    int i;
+
+    for (i = 0; i + 2 <= count; i += 2) {
+        __m128i value = _mm_loadu_si128 ((const __m128i*)&deadline[i]);
+        __m128i later = _mm_cmpgt_epi64 (value, limit);
+        mask |= (unsigned long long)(~_mm_movemask_pd (_mm_castsi128_pd (later)) & 0x3) << i;
+        least = _mm_blendv_epi8 (least, value,
+            _mm_and_si128 (later, _mm_cmpgt_epi64 (least, value)));
+    }
+    _mm_storeu_si128 ((__m128i*)lane, least);
+    for (int j = 0; j < 2; j++)
+        if (lane[j] < *next)
+            *next = lane[j];
+    if (i < count)
+        mask |= due_scan_scalar (&deadline[i], count - i, now, next) << i;
+    return mask;
+}
+
+__attribute__ ((target ("avx2")))
+static inline unsigned long long due_scan_avx2 (
+    const long long *deadline, int count, long long now, long long *next)
+{
+    __m256i limit = _mm256_set1_epi64x (now), least = _mm256_set1_epi64x (*next);
+    unsigned long long mask = 0;
+    long long lane[4];
+    int i;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m256i value = _mm256_loadu_si256 ((const __m256i*)&deadline[i]);
+        __m256i later = _mm256_cmpgt_epi64 (value, limit);
+        mask |= (unsigned long long)(~_mm256_movemask_pd (_mm256_castsi256_pd (later)) & 0xf) << i;
+        least = _mm256_blendv_epi8 (least, value,
+            _mm256_and_si256 (later, _mm256_cmpgt_epi64 (least, value)));
+    }
+    _mm256_storeu_si256 ((__m256i*)lane, least);
+    for (int j = 0; j < 4; j++)
+        if (lane[j] < *next)
+            *next = lane[j];
+    if (i < count)
+        mask |= due_scan_scalar (&deadline[i], count - i, now, next) << i;
+    return mask;
+}
+#endif
+
+static inline due_scan_t due_scan_select (void)
+{
+#ifdef DUE_SCAN_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2"))
+        return due_scan_avx2;
+    if (__builtin_cpu_supports ("sse4.2"))
+        return due_scan_sse42;
+#endif
+    return due_scan_scalar;
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * due_scan_bench.c
+ *
+ * Microbenchmark for the due-alarm kernels in due_scan.h, which
+ * new_alarm_cond.c uses when built with -DSCHED_SCAN. It fills a
+ * table of deadlines like a shard's, with about one in a hundred
+ * due, and has each kernel the CPU supports scan it repeatedly
+ * in DUE_BLOCK blocks, finding the due alarms and the earliest of
+ * the rest as alarm_expire does, and reports the deadlines scanned
+ * per nanosecond.
+ *
+ *      gcc -O2 due_scan_bench.c -o due_scan_bench
+ *      ./due_scan_bench [deadlines [passes]]
+ */
+#include <limits.h>
+#include <time.h>
+#include "errors.h"
+#include "due_scan.h"
+
+long long bench_tick (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void bench (const char *name, due_scan_t scan,
+    const long long *deadline, int count, int passes, long long now)
+{
+    unsigned long long due = 0;
+    long long start, elapsed, next = LLONG_MAX;
+    int base;
+
+    start = bench_tick ();
+    for (int pass = 0; pass < passes; pass++) {
+        next = LLONG_MAX;
+        for (base = 0; base < count; base += DUE_BLOCK)
+            due += __builtin_popcountll (scan (&deadline[base],
+                count - base < DUE_BLOCK ? count - base : DUE_BLOCK, now, &next));
+    }
+    elapsed = bench_tick () - start;
+    printf ("%-8s %d deadlines x %d passes: %.2f alarms scanned per ns (%llu due, next in %lld)\n",
+        name, count, passes, (double)count * passes / elapsed, due / passes, next - now);
+}
+
+int main (int argc, char *argv[])
+{
+    long long *deadline, now = 1000000000LL;
+    int count = 4096, passes = 100000;
+
+    if (argc > 1)
+        count = atoi (argv[1]);
+    if (argc > 2)
+        passes = atoi (argv[2]);
+    if (count < 1 || passes < 1) {
+        fprintf (stderr, "Usage: %s [deadlines [passes]]\n", argv[0]);
+        exit (1);
+    }
+
+    deadline = malloc (count * sizeof (long long));
+    if (deadline == NULL)
+        errno_abort ("Allocate deadlines");
+    srand (1);
+    for (int i = 0; i < count; i++)
+        deadline[i] = now + (rand () % 100 == 0 ? -1 : 1) * (rand () % 1000000 + 1);
+
+    bench ("scalar", due_scan_scalar, deadline, count, passes, now);
+#ifdef DUE_SCAN_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse4.2"))
+        bench ("sse4.2", due_scan_sse42, deadline, count, passes, now);
+    if (__builtin_cpu_supports ("avx2"))
+        bench ("avx2", due_scan_avx2, deadline, count, passes, now);
+#endif
+    free (deadline);
+    return 0;
+}
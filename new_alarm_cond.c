@@ -10,395 +10,2551 @@
  * so that the alarm thread will wake up and process the earlier
  * timeout first, requeueing the later request.
  */
+#include <ctype.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
+#ifdef ENGINE_TIMERFD
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+# include <sys/timerfd.h>
+#endif
 #include "errors.h"
+#ifdef SCHED_SCAN
+# include "due_scan.h"
+#endif
+
+/*
+ * The "alarm" structure now contains the deadline (CLOCK_MONOTONIC
+ * time, in nanoseconds) for each alarm, so that they can be
+ * sorted. Storing the requested period would not be enough, since
+ * the "alarm thread" cannot tell how long it has been on the list.
+ * The monotonic clock is not disturbed by wall-clock changes.
+ *
+ * What the deadline store and the timer look at on every pass
+ * comes first, in a 32-byte header (half a cache line); the rest is
+ * only touched when an alarm fires or is changed. The message text
+ * lives out of line, in the shard's message arena, which keeps an
+ * alarm within a cache line however long its message is. Alarms
+ * are padded out to exactly one line, so that in a slab (see
+ * alarm_alloc) none of them, and no header, straddles two.
+ */
+typedef struct alarm_tag {
+    long long           deadline;       /* while suspended, the
+                                           nanoseconds that were left */
+    int                 id;
+    int                 groupId;
+    struct alarm_tag    *sched_next;    /* deadline store linkage */
+    struct alarm_tag    *sched_prev;
+    long long           period;         /* nanoseconds */
+    char                *message;       /* see message_intern */
+    struct worker_tag   *worker;        /* its group's home, while active */
+    int                 sched_slot;     /* -1 when not scheduled */
+} __attribute__ ((aligned (64))) alarm_t;
+
+_Static_assert (sizeof (alarm_t) == 64, "alarm_t must fill one cache line");
+
+/*
+ * A fired alarm as handed to the display workers. It is a copy, so
+ * a worker prints it without holding a shard's mutex while the
+ * alarm itself is re-armed, changed or cancelled.
+ */
+typedef struct fired_tag {
+    int                 id;
+    int                 groupId;
+    long long           period;
+    long long           skipped;        /* periods missed before this one */
+    char                message[];
+} fired_t;
+
+/*
+ * The display alarm threads are a fixed pool of workers (by
+ * default one per core) rather than one thread per group. Each
+ * group has a home worker, and the alarm thread pushes the group's
+ * fired alarms onto that worker's deque. A worker takes the oldest
+ * entry of its own deque; when that is empty, it steals the newest
+ * entry from another worker's, so a burst in one group is spread
+ * over every idle worker. With -o, stealing is disabled and each
+ * group's alarms are printed in firing order by its home worker.
+ *
+ * Each deque is a ring buffer guarded by the worker's own mutex. A
+ * worker never takes a shard's mutex while printing. A worker sets
+ * "idle" before its last look for work and then sleeps on "ready";
+ * a push that leaves a backlog kicks one idle worker to steal it.
+ */
+typedef struct worker_tag {
+    pthread_t           thread;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      ready;
+    fired_t             **deque;
+    int                 head;
+    int                 count;
+    int                 size;
+    int                 idle;
+    int                 kicked;
+    int                 groups;         /* groups at home here */
+} worker_t;
+
+worker_t *workers;
+int worker_count;
+int ordered = 0;        /* -o: keep each group's alarms in order */
+
+/*
+ * Per-group state, kept in the group registry for as long as the
+ * group has active alarms or a home worker.
+ */
+typedef struct group_tag {
+    int                 id;
+    int                 alarms;         /* active alarms in the group */
+    worker_t            *worker;        /* home display worker, or NULL */
+} group_t;
+
+/*
+ * Each group thread has its own wakeup channel: a queue of events
+ * naming the alarm that changed and the group it joined or left, so
+ * the thread handles just that alarm instead of rescanning the
+ * index on every command. The queue is a ring buffer guarded by the
+ * group_mutex; events posted while the thread is busy (or not yet
+ * waiting) stay queued rather than being lost like a broadcast. An
+ * event carries what the creation thread logs, so it never has to
+ * look into the alarm store.
+ */
+typedef struct group_event_tag {
+    int                 alarmId;
+    int                 groupId;
+    long long           period;
+    char                *message;       /* creation only: a copy the thread frees */
+    worker_t            *worker;        /* creation only: the group's home */
+    int                 assigned;       /* ... given to it by this join */
+} group_event_t;
+
+/*
+ * A command's effect on a group. A shard records these while it
+ * applies a batch and carries them out in order once the batch is
+ * done (see group_apply), so the group_mutex is taken once per
+ * batch instead of being held across it. A join carries the event
+ * the creation thread will be given, message copy and all.
+ */
+typedef struct group_change_tag {
+    int                 delta;          /* +1 joins, -1 leaves */
+    group_event_t       event;
+} group_change_t;
+
+typedef struct channel_tag {
+    pthread_cond_t      cond;
+    group_event_t       *event;
+    int                 head;
+    int                 count;
+    int                 size;
+} channel_t;
+
+pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER;   /* groups, channels, worker loads */
+channel_t creation_channel = { .cond = PTHREAD_COND_INITIALIZER };   /* alarms joining a group */
+channel_t removal_channel = { .cond = PTHREAD_COND_INITIALIZER };    /* alarms leaving a group */
+long long timer_slack = 0;      /* -s: how late an alarm may fire to share a wakeup */
+int batch_size = 1024;          /* -b: most commands a shard applies at once */
+
+/*
+ * Deadlines are kept in CLOCK_MONOTONIC nanoseconds.
+ */
+#define TICKS_PER_SEC   1000000000LL
+
+/*
+ * Current tick.
+ */
+long long current_tick (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * TICKS_PER_SEC + now.tv_nsec;
+}
+
+/*
+ * Tick at which an alarm is due.
+ */
+long long alarm_tick (alarm_t *alarm)
+{
+    return alarm->deadline;
+}
+
+/*
+ * Parse a duration in seconds, with an optional fraction down to
+ * nanoseconds ("2", "0.25", "1.000000001"). Returns the duration
+ * in nanoseconds, or -1 if the text is not a positive duration.
+ */
+long long parse_duration (const char *text)
+{
+    long long whole = 0, fraction = 0, scale = TICKS_PER_SEC;
+
+    if (*text < '0' || *text > '9')
+        return -1;
+    while (*text >= '0' && *text <= '9') {
+        whole = whole * 10 + (*text++ - '0');
+        if (whole > 1000000000LL)
+            return -1;
+    }
+    if (*text == '.') {
+        text++;
+        while (*text >= '0' && *text <= '9') {
+            if ((scale /= 10) == 0)
+                return -1;
+            fraction += (*text++ - '0') * scale;
+        }
+    }
+    if (*text != '\0' || whole * TICKS_PER_SEC + fraction == 0)
+        return -1;
+    return whole * TICKS_PER_SEC + fraction;
+}
+
+/*
+ * Format a duration in nanoseconds as seconds, with only as many
+ * fraction digits as it needs.
+ */
+char *format_duration (long long duration, char *buffer, size_t size)
+{
+    long long fraction = duration % TICKS_PER_SEC;
+    int digits = 9;
+
+    if (fraction == 0) {
+        snprintf (buffer, size, "%lld", duration / TICKS_PER_SEC);
+        return buffer;
+    }
+    while (fraction % 10 == 0) {
+        fraction /= 10;
+        digits--;
+    }
+    snprintf (buffer, size, "%lld.%0*lld",
+        duration / TICKS_PER_SEC, digits, fraction);
+    return buffer;
+}
+
+/*
+ * The deadline store is chosen at build time:
+ *
+ *      (default)       hierarchical timing wheel
+ *      -DSCHED_HEAP    binary min-heap
+ *      -DSCHED_LIST    sorted linked list
+ *      -DSCHED_SCAN    flat deadline array, scanned
+ *
+ * Each backend defines sched_t and the routines sched_init,
+ * sched_link, sched_unlink, sched_rekey (move a linked alarm to
+ * its updated deadline), sched_next and sched_advance. All of
+ * them require that the caller have locked the mutex of the shard
+ * that owns the store.
+ */
+#if defined(SCHED_HEAP)
+/*
+ * Array-backed binary min-heap. Each entry carries its deadline
+ * next to the alarm pointer, so sifting compares contiguous keys
+ * without touching the alarms, and each alarm records its heap
+ * index in sched_slot so it can be removed without a search.
+ * Insert, removal and popping the earliest are O(log n).
+ */
+typedef struct heap_entry_tag {
+    long long           tick;
+    alarm_t             *alarm;
+} heap_entry_t;
+
+typedef struct alarm_heap_tag {
+    heap_entry_t        *entry;
+    int                 count;
+    int                 size;
+} alarm_heap_t;
+
+void heap_init (alarm_heap_t *heap, long long now)
+{
+    heap->entry = NULL;
+    heap->count = heap->size = 0;
+}
+
+/*
+ * Store an entry at index "i" and record the index in its alarm.
+ */
+void heap_set (alarm_heap_t *heap, int i, heap_entry_t entry)
+{
+    heap->entry[i] = entry;
+    entry.alarm->sched_slot = i;
+}
+
+void heap_sift_up (alarm_heap_t *heap, int i)
+{
+    heap_entry_t entry = heap->entry[i];
+    int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (heap->entry[parent].tick <= entry.tick)
+            break;
+        heap_set (heap, i, heap->entry[parent]);
+        i = parent;
+    }
+    heap_set (heap, i, entry);
+}
+
+void heap_sift_down (alarm_heap_t *heap, int i)
+{
+    heap_entry_t entry = heap->entry[i];
+    int child;
+
+    while ((child = 2 * i + 1) < heap->count) {
+        if (child + 1 < heap->count
+            && heap->entry[child + 1].tick < heap->entry[child].tick)
+            child++;
+        if (entry.tick <= heap->entry[child].tick)
+            break;
+        heap_set (heap, i, heap->entry[child]);
+        i = child;
+    }
+    heap_set (heap, i, entry);
+}
+
+void heap_link (alarm_heap_t *heap, alarm_t *alarm)
+{
+    heap_entry_t *entry;
+
+    if (heap->count == heap->size) {
+        heap->size = heap->size ? heap->size * 2 : 64;
+        entry = realloc (heap->entry, heap->size * sizeof (heap_entry_t));
+        if (entry == NULL)
+            errno_abort ("Grow alarm heap");
+        heap->entry = entry;
+    }
+    heap->entry[heap->count].tick = alarm_tick (alarm);
+    heap->entry[heap->count].alarm = alarm;
+    heap_sift_up (heap, heap->count++);
+}
+
+void heap_unlink (alarm_heap_t *heap, alarm_t *alarm)
+{
+    int i = alarm->sched_slot;
+
+    alarm->sched_slot = -1;
+    if (--heap->count == i)
+        return;
+    heap_set (heap, i, heap->entry[heap->count]);
+    if (i > 0 && heap->entry[(i - 1) / 2].tick > heap->entry[i].tick)
+        heap_sift_up (heap, i);
+    else
+        heap_sift_down (heap, i);
+}
+
+/*
+ * Decrease- or increase-key in place: sift the entry whichever
+ * way its new deadline requires.
+ */
+void heap_rekey (alarm_heap_t *heap, alarm_t *alarm)
+{
+    int i = alarm->sched_slot;
+    long long tick = alarm_tick (alarm);
+
+    if (tick < heap->entry[i].tick) {
+        heap->entry[i].tick = tick;
+        heap_sift_up (heap, i);
+    } else {
+        heap->entry[i].tick = tick;
+        heap_sift_down (heap, i);
+    }
+}
+
+long long heap_next (alarm_heap_t *heap)
+{
+    return heap->count > 0 ? heap->entry[0].tick : -1;
+}
+
+alarm_t *heap_advance (alarm_heap_t *heap, long long target)
+{
+    alarm_t *expired = NULL, *alarm;
+
+    while (heap->count > 0 && heap->entry[0].tick <= target) {
+        alarm = heap->entry[0].alarm;
+        heap_unlink (heap, alarm);
+        alarm->sched_next = expired;
+        expired = alarm;
+    }
+    return expired;
+}
+
+typedef alarm_heap_t sched_t;
+# define sched_init(s, now)      heap_init (s, now)
+# define sched_link(s, a)        heap_link (s, a)
+# define sched_unlink(s, a)      heap_unlink (s, a)
+# define sched_rekey(s, a)       heap_rekey (s, a)
+# define sched_next(s)           heap_next (s)
+# define sched_advance(s, t)     heap_advance (s, t)
+
+#elif defined(SCHED_LIST)
+/*
+ * The original deadline-ordered list, kept as a reference point:
+ * O(n) insert, O(1) removal and expiry.
+ */
+typedef struct deadline_list_tag {
+    alarm_t             *head;
+} deadline_list_t;
+
+void list_init (deadline_list_t *list, long long now)
+{
+    list->head = NULL;
+}
+
+/*
+ * Insert alarm entry on list, in order.
+ */
+void list_link (deadline_list_t *list, alarm_t *alarm)
+{
+    alarm_t **last, *next, *prev = NULL;
+
+    last = &list->head;
+    next = *last;
+    while (next != NULL && alarm_tick (next) < alarm_tick (alarm)) {
+        prev = next;
+        last = &next->sched_next;
+        next = next->sched_next;
+    }
+    alarm->sched_next = next;
+    alarm->sched_prev = prev;
+    if (next != NULL)
+        next->sched_prev = alarm;
+    *last = alarm;
+    alarm->sched_slot = 0;
+}
+
+void list_unlink (deadline_list_t *list, alarm_t *alarm)
+{
+    if (alarm->sched_prev != NULL)
+        alarm->sched_prev->sched_next = alarm->sched_next;
+    else
+        list->head = alarm->sched_next;
+    if (alarm->sched_next != NULL)
+        alarm->sched_next->sched_prev = alarm->sched_prev;
+    alarm->sched_next = alarm->sched_prev = NULL;
+    alarm->sched_slot = -1;
+}
+
+void list_rekey (deadline_list_t *list, alarm_t *alarm)
+{
+    list_unlink (list, alarm);
+    list_link (list, alarm);
+}
+
+long long list_next (deadline_list_t *list)
+{
+    return list->head != NULL ? alarm_tick (list->head) : -1;
+}
+
+alarm_t *list_advance (deadline_list_t *list, long long target)
+{
+    alarm_t *expired = NULL, *alarm;
+
+    while ((alarm = list->head) != NULL && alarm_tick (alarm) <= target) {
+        list_unlink (list, alarm);
+        alarm->sched_next = expired;
+        expired = alarm;
+    }
+    return expired;
+}
+
+typedef deadline_list_t sched_t;
+# define sched_init(s, now)      list_init (s, now)
+# define sched_link(s, a)        list_link (s, a)
+# define sched_unlink(s, a)      list_unlink (s, a)
+# define sched_rekey(s, a)       list_rekey (s, a)
+# define sched_next(s)           list_next (s)
+# define sched_advance(s, t)     list_advance (s, t)
+
+#elif defined(SCHED_SCAN)
+/*
+ * Structure of arrays: the deadlines of the scheduled alarms are
+ * packed into one array, and the alarms themselves (everything
+ * else about them, which a scan does not need) into a parallel
+ * one, each alarm recording its index in sched_slot. Link appends
+ * and unlink moves the last entry into the hole, so both are O(1)
+ * and the arrays stay dense. Finding the due alarms is O(n), but
+ * it is a sequential pass over the deadlines alone, eight to a
+ * cache line, and touches only the alarms that are due. The due
+ * alarms are found DUE_BLOCK at a time by the fastest kernel in
+ * due_scan.h that the CPU supports, which finds the earliest of
+ * the deadlines left in the same pass. That is kept in "next" and
+ * kept up to date by link and rekey, so the timer's usual pass is
+ * one scan; only unlinking or postponing the earliest alarm (a
+ * cancel, say) leaves it stale, and then table_next scans again.
+ */
+typedef struct alarm_table_tag {
+    long long           *deadline;
+    alarm_t             **alarm;
+    int                 count;
+    int                 size;
+    long long           next;           /* earliest deadline, LLONG_MAX if none */
+    int                 stale;          /* next must be found again */
+    due_scan_t          scan;
+} alarm_table_t;
+
+void table_init (alarm_table_t *table, long long now)
+{
+    table->deadline = NULL;
+    table->alarm = NULL;
+    table->count = table->size = 0;
+    table->next = LLONG_MAX;
+    table->stale = 0;
+    table->scan = due_scan_select ();
+}
+
+void table_link (alarm_table_t *table, alarm_t *alarm)
+{
+    long long *deadline;
+    alarm_t **alarms;
+
+    if (table->count == table->size) {
+        table->size = table->size ? table->size * 2 : 64;
+        deadline = realloc (table->deadline, table->size * sizeof (long long));
+        alarms = realloc (table->alarm, table->size * sizeof (alarm_t *));
+        if (deadline == NULL || alarms == NULL)
+            errno_abort ("Grow alarm table");
+        table->deadline = deadline;
+        table->alarm = alarms;
+    }
+    table->deadline[table->count] = alarm_tick (alarm);
+    table->alarm[table->count] = alarm;
+    if (table->deadline[table->count] < table->next)
+        table->next = table->deadline[table->count];
+    alarm->sched_slot = table->count++;
+}
+
+void table_unlink (alarm_table_t *table, alarm_t *alarm)
+{
+    int i = alarm->sched_slot;
+
+    alarm->sched_slot = -1;
+    if (table->deadline[i] == table->next)
+        table->stale = 1;
+    if (--table->count == i)
+        return;
+    table->deadline[i] = table->deadline[table->count];
+    table->alarm[i] = table->alarm[table->count];
+    table->alarm[i]->sched_slot = i;
+}
+
+void table_rekey (alarm_table_t *table, alarm_t *alarm)
+{
+    long long *deadline = &table->deadline[alarm->sched_slot];
+
+    if (*deadline == table->next)
+        table->stale = 1;
+    *deadline = alarm_tick (alarm);
+    if (*deadline < table->next)
+        table->next = *deadline;
+}
+
+long long table_next (alarm_table_t *table)
+{
+    int base;
+
+    /*
+     * Nothing is due before LLONG_MIN, so the kernels just find
+     * the earliest deadline.
+     */
+    if (table->stale) {
+        table->next = LLONG_MAX;
+        for (base = 0; base < table->count; base += DUE_BLOCK)
+            table->scan (&table->deadline[base],
+                table->count - base < DUE_BLOCK ? table->count - base : DUE_BLOCK,
+                LLONG_MIN, &table->next);
+        table->stale = 0;
+    }
+    return table->next == LLONG_MAX ? -1 : table->next;
+}
+
+/*
+ * The scan runs from the end, block by block and within a block
+ * from the highest due bit down, so the entry that unlinking moves
+ * into a hole has already been looked at (and was not due). What
+ * is not due stays, so the earliest of that is the table's next.
+ */
+alarm_t *table_advance (alarm_table_t *table, long long target)
+{
+    alarm_t *expired = NULL, *alarm;
+    unsigned long long due;
+    long long next = LLONG_MAX;
+    int base, count, i;
+
+    for (base = (table->count - 1) & ~(DUE_BLOCK - 1); base >= 0; base -= DUE_BLOCK) {
+        count = table->count - base < DUE_BLOCK ? table->count - base : DUE_BLOCK;
+        due = table->scan (&table->deadline[base], count, target, &next);
+        while (due != 0) {
+            i = 63 - __builtin_clzll (due);
+            due &= ~(1ULL << i);
+            alarm = table->alarm[base + i];
+            table_unlink (table, alarm);
+            alarm->sched_next = expired;
+            expired = alarm;
+        }
+    }
+    table->next = next;
+    table->stale = 0;
+    return expired;
+}
+
+typedef alarm_table_t sched_t;
+# define sched_init(s, now)      table_init (s, now)
+# define sched_link(s, a)        table_link (s, a)
+# define sched_unlink(s, a)      table_unlink (s, a)
+# define sched_rekey(s, a)       table_rekey (s, a)
+# define sched_next(s)           table_next (s)
+# define sched_advance(s, t)     table_advance (s, t)
+
+#else
+/*
+ * Hierarchical timing wheel used as the deadline store.
+ *
+ * The wheel has four
+ * levels -- 1000 one-millisecond slots, 60 one-second slots, 60
+ * one-minute slots and 24 one-hour slots -- plus an overflow slot
+ * for anything beyond the current day. An alarm is filed at the
+ * highest level on which its deadline differs from the wheel's
+ * current tick, in the slot for its digit at that level. When the
+ * wheel reaches the start of a second, minute, hour or day, the
+ * matching slot is "cascaded": its alarms are filed again relative
+ * to the new tick, which moves them down a level. Alarms in the
+ * millisecond slot for the current tick have expired.
+ *
+ * Each slot is a doubly linked list, so insert and removal are
+ * O(1), and every alarm cascades at most once per level. A bitmap
+ * of non-empty slots lets wheel_work() find the next tick with
+ * work without walking empty slots.
+ *
+ * The wheel counts in its own one-millisecond ticks. Deadlines are
+ * rounded up to the next wheel tick, so alarms never fire early.
+ */
+#define WHEEL_RES       (TICKS_PER_SEC / 1000)
+#define WHEEL_SEC       1000LL
+#define WHEEL_MIN       (60 * WHEEL_SEC)
+#define WHEEL_HOUR      (60 * WHEEL_MIN)
+#define WHEEL_DAY       (24 * WHEEL_HOUR)
+#define WHEEL_MS_BASE   0
+#define WHEEL_SEC_BASE  (WHEEL_MS_BASE + 1000)
+#define WHEEL_MIN_BASE  (WHEEL_SEC_BASE + 60)
+#define WHEEL_HOUR_BASE (WHEEL_MIN_BASE + 60)
+#define WHEEL_OVERFLOW  (WHEEL_HOUR_BASE + 24)
+#define WHEEL_SLOTS     (WHEEL_OVERFLOW + 1)
+
+typedef struct timing_wheel_tag {
+    long long           now;    /* wheel tick it has been advanced to */
+    alarm_t             *slot[WHEEL_SLOTS];
+    unsigned long long  map[(WHEEL_SLOTS + 63) / 64];
+} timing_wheel_t;
+
+void wheel_init (timing_wheel_t *wheel, long long now)
+{
+    memset (wheel, 0, sizeof (*wheel));
+    wheel->now = now / WHEEL_RES;
+}
+
+/*
+ * Return the first non-empty slot in [from, to), or -1.
+ */
+int wheel_find (timing_wheel_t *wheel, int from, int to)
+{
+    unsigned long long bits;
+    int word;
+
+    while (from < to) {
+        word = from / 64;
+        bits = wheel->map[word] >> (from % 64);
+        if (bits != 0) {
+            from += __builtin_ctzll (bits);
+            return from < to ? from : -1;
+        }
+        from = (word + 1) * 64;
+    }
+    return -1;
+}
+
+/*
+ * File an alarm in the slot for its deadline, relative to the
+ * wheel's current tick.
+ */
+void wheel_link (timing_wheel_t *wheel, alarm_t *alarm)
+{
+    long long tick = (alarm_tick (alarm) + WHEEL_RES - 1) / WHEEL_RES;
+    long long now = wheel->now;
+    int slot;
+
+    if (tick < now)
+        tick = now;
+    if (tick / WHEEL_DAY != now / WHEEL_DAY)
+        slot = WHEEL_OVERFLOW;
+    else if (tick / WHEEL_HOUR != now / WHEEL_HOUR)
+        slot = WHEEL_HOUR_BASE + (tick / WHEEL_HOUR) % 24;
+    else if (tick / WHEEL_MIN != now / WHEEL_MIN)
+        slot = WHEEL_MIN_BASE + (tick / WHEEL_MIN) % 60;
+    else if (tick / WHEEL_SEC != now / WHEEL_SEC)
+        slot = WHEEL_SEC_BASE + (tick / WHEEL_SEC) % 60;
+    else
+        slot = WHEEL_MS_BASE + tick % WHEEL_SEC;
+
+    alarm->sched_slot = slot;
+    alarm->sched_prev = NULL;
+    alarm->sched_next = wheel->slot[slot];
+    if (alarm->sched_next != NULL)
+        alarm->sched_next->sched_prev = alarm;
+    wheel->slot[slot] = alarm;
+    wheel->map[slot / 64] |= 1ULL << (slot % 64);
+}
+
+/*
+ * Remove an alarm from whichever slot holds it.
+ */
+void wheel_unlink (timing_wheel_t *wheel, alarm_t *alarm)
+{
+    int slot = alarm->sched_slot;
+
+    if (alarm->sched_prev != NULL)
+        alarm->sched_prev->sched_next = alarm->sched_next;
+    else
+        wheel->slot[slot] = alarm->sched_next;
+    if (alarm->sched_next != NULL)
+        alarm->sched_next->sched_prev = alarm->sched_prev;
+    if (wheel->slot[slot] == NULL)
+        wheel->map[slot / 64] &= ~(1ULL << (slot % 64));
+    alarm->sched_next = alarm->sched_prev = NULL;
+    alarm->sched_slot = -1;
+}
+
+/*
+ * Move an alarm to the slot for its new deadline.
+ */
+void wheel_rekey (timing_wheel_t *wheel, alarm_t *alarm)
+{
+    wheel_unlink (wheel, alarm);
+    wheel_link (wheel, alarm);
+}
+
+/*
+ * Return the next wheel tick at which the wheel has work -- an
+ * expiry on the millisecond level or a cascade from a higher level
+ * -- or -1 if the wheel is empty. Higher-level slots at or before
+ * the current digit are always empty, so only later slots are
+ * searched.
+ */
+long long wheel_work (timing_wheel_t *wheel)
+{
+    long long now = wheel->now;
+    int slot;
+
+    slot = wheel_find (wheel,
+        WHEEL_MS_BASE + now % WHEEL_SEC, WHEEL_SEC_BASE);
+    if (slot >= 0)
+        return now - now % WHEEL_SEC + (slot - WHEEL_MS_BASE);
+    slot = wheel_find (wheel,
+        WHEEL_SEC_BASE + (now / WHEEL_SEC) % 60 + 1, WHEEL_MIN_BASE);
+    if (slot >= 0)
+        return now - now % WHEEL_MIN + (slot - WHEEL_SEC_BASE) * WHEEL_SEC;
+    slot = wheel_find (wheel,
+        WHEEL_MIN_BASE + (now / WHEEL_MIN) % 60 + 1, WHEEL_HOUR_BASE);
+    if (slot >= 0)
+        return now - now % WHEEL_HOUR + (slot - WHEEL_MIN_BASE) * WHEEL_MIN;
+    slot = wheel_find (wheel,
+        WHEEL_HOUR_BASE + (now / WHEEL_HOUR) % 24 + 1, WHEEL_OVERFLOW);
+    if (slot >= 0)
+        return now - now % WHEEL_DAY + (slot - WHEEL_HOUR_BASE) * WHEEL_HOUR;
+    if (wheel->slot[WHEEL_OVERFLOW] != NULL)
+        return now - now % WHEEL_DAY + WHEEL_DAY;
+    return -1;
+}
+
+long long wheel_next (timing_wheel_t *wheel)
+{
+    long long tick = wheel_work (wheel);
+
+    return tick < 0 ? -1 : tick * WHEEL_RES;
+}
+
+/*
+ * Re-file every alarm in a higher-level slot relative to the
+ * wheel's (new) current tick.
+ */
+void wheel_cascade (timing_wheel_t *wheel, int slot)
+{
+    alarm_t *alarm, *next;
+
+    alarm = wheel->slot[slot];
+    wheel->slot[slot] = NULL;
+    wheel->map[slot / 64] &= ~(1ULL << (slot % 64));
+    while (alarm != NULL) {
+        next = alarm->sched_next;
+        wheel_link (wheel, alarm);
+        alarm = next;
+    }
+}
+
+/*
+ * Advance the wheel to "target", jumping directly between ticks
+ * that have work. Returns the expired alarms, chained through
+ * sched_next; they are no longer in the wheel.
+ */
+alarm_t *wheel_advance (timing_wheel_t *wheel, long long target)
+{
+    alarm_t *expired = NULL, *alarm;
+    long long tick;
+    int slot;
+
+    target /= WHEEL_RES;
+    while ((tick = wheel_work (wheel)) >= 0 && tick <= target) {
+        wheel->now = tick;
+        if (tick % WHEEL_DAY == 0)
+            wheel_cascade (wheel, WHEEL_OVERFLOW);
+        if (tick % WHEEL_HOUR == 0)
+            wheel_cascade (wheel,
+                WHEEL_HOUR_BASE + (tick / WHEEL_HOUR) % 24);
+        if (tick % WHEEL_MIN == 0)
+            wheel_cascade (wheel, WHEEL_MIN_BASE + (tick / WHEEL_MIN) % 60);
+        if (tick % WHEEL_SEC == 0)
+            wheel_cascade (wheel, WHEEL_SEC_BASE + (tick / WHEEL_SEC) % 60);
+        slot = WHEEL_MS_BASE + tick % WHEEL_SEC;
+        while ((alarm = wheel->slot[slot]) != NULL) {
+            wheel_unlink (wheel, alarm);
+            alarm->sched_next = expired;
+            expired = alarm;
+        }
+    }
+    if (target > wheel->now)
+        wheel->now = target;
+    return expired;
+}
+
+typedef timing_wheel_t sched_t;
+# define sched_init(s, now)      wheel_init (s, now)
+# define sched_link(s, a)        wheel_link (s, a)
+# define sched_unlink(s, a)      wheel_unlink (s, a)
+# define sched_rekey(s, a)       wheel_rekey (s, a)
+# define sched_next(s)           wheel_next (s)
+# define sched_advance(s, t)     wheel_advance (s, t)
+#endif
+
+/*
+ * Hash table of pointers, used for the alarm indexes, the group
+ * registry (whose entries are encoded positions) and the message
+ * intern table. Open addressing with
+ * linear probing, kept at most three-quarters full; removal shifts
+ * later entries of the probe run back, so there are no tombstones
+ * and a lookup stops at the first empty slot. The caller supplies
+ * the hash of an entry (and, for a lookup, of the key), so the
+ * table never looks inside the entries except through "match".
+ */
+typedef unsigned int (*probe_hash_t) (const void *entry);
+
+typedef struct probe_table_tag {
+    void                **slot;
+    unsigned int        size;   /* a power of two */
+    unsigned int        count;
+} probe_table_t;
+
+/*
+ * Hash of an integer id, for the tables keyed by alarm or group id.
+ */
+unsigned int id_hash (int id)
+{
+    unsigned int hash = (unsigned int)id * 2654435769u;
+
+    return hash ^ (hash >> 16);
+}
+
+void *probe_find (probe_table_t *table, unsigned int hash,
+    int (*match) (const void *entry, const void *key), const void *key)
+{
+    unsigned int mask = table->size - 1, i;
+    void *entry;
+
+    if (table->count == 0)
+        return NULL;
+    for (i = hash & mask; (entry = table->slot[i]) != NULL; i = (i + 1) & mask)
+        if (match (entry, key))
+            return entry;
+    return NULL;
+}
+
+/*
+ * Add an entry that is not already present.
+ */
+void probe_insert (probe_table_t *table, void *entry, probe_hash_t hash)
+{
+    void **old = table->slot;
+    unsigned int old_size = table->size, i;
+
+    if ((table->count + 1) * 4 > table->size * 3) {
+        table->size = old_size ? old_size * 2 : 64;
+        table->slot = calloc (table->size, sizeof (void *));
+        if (table->slot == NULL)
+            errno_abort ("Grow hash table");
+        table->count = 0;
+        for (i = 0; i < old_size; i++)
+            if (old[i] != NULL)
+                probe_insert (table, old[i], hash);
+        free (old);
+    }
+    for (i = hash (entry) & (table->size - 1); table->slot[i] != NULL;
+            i = (i + 1) & (table->size - 1))
+        ;
+    table->slot[i] = entry;
+    table->count++;
+}
+
+void probe_remove (probe_table_t *table, void *entry, probe_hash_t hash)
+{
+    unsigned int mask = table->size - 1, i, j, home;
+
+    for (i = hash (entry) & mask; table->slot[i] != entry; i = (i + 1) & mask)
+        ;
+    table->slot[i] = NULL;
+    table->count--;
+
+    /*
+     * Pull back any later entry of the probe run whose home slot
+     * is not in the (cyclic) range (i, j], so it stays reachable.
+     */
+    for (j = (i + 1) & mask; table->slot[j] != NULL; j = (j + 1) & mask) {
+        home = hash (table->slot[j]) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table->slot[i] = table->slot[j];
+            table->slot[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/*
+ * Hash index from alarm id to alarm, maintained under the shard
+ * mutex alongside the deadline store, so that requests
+ * naming an alarm find it in O(1) instead of walking a list.
+ */
+typedef probe_table_t alarm_index_t;
+
+unsigned int index_hash (const void *entry)
+{
+    return id_hash (((const alarm_t*)entry)->id);
+}
+
+int index_match (const void *entry, const void *key)
+{
+    return ((const alarm_t*)entry)->id == *(const int*)key;
+}
+
+alarm_t *index_lookup (alarm_index_t *index, int id)
+{
+    return probe_find (index, id_hash (id), index_match, &id);
+}
+
+void index_insert (alarm_index_t *index, alarm_t *alarm)
+{
+    probe_insert (index, alarm, index_hash);
+}
+
+void index_remove (alarm_index_t *index, alarm_t *alarm)
+{
+    probe_remove (index, alarm, index_hash);
+}
+
+/*
+ * A parsed command on its way to the shard that owns its alarm id.
+ * Commands are pushed onto the shard's inbox without taking any
+ * lock, and the shard's alarm thread applies them in arrival order.
+ */
+enum { CMD_START, CMD_CHANGE, CMD_CANCEL, CMD_SUSPEND, CMD_REACTIVATE };
+
+typedef struct command_tag {
+    struct command_tag  *next;
+    int                 type;
+    int                 id;
+    int                 groupId;
+    long long           period;
+    pthread_t           source;         /* thread that parsed it */
+    char                message[];
+} command_t;
+
+/*
+ * A pool of recycled blocks, for the objects that one thread makes
+ * and another frees: commands, made by the input thread and freed
+ * by a shard's timer, and fired alarms and the creation thread's
+ * message copies, made by a shard's timer and freed by the display
+ * threads. Blocks come in power-of-two size classes, POOL_MIN bytes
+ * and up, and stay with the pool they were made for.
+ */
+#define POOL_MIN        64
+#define POOL_CLASSES    6               /* up to 2048 bytes */
+
+typedef struct pool_block_tag {
+    struct pool_block_tag *next;        /* while free */
+    struct block_pool_tag *pool;        /* NULL if from malloc */
+    int                 class;
+    void                *data[];        /* what the block holds */
+} pool_block_t;
+
+typedef struct block_pool_tag {
+    pool_block_t        *free[POOL_CLASSES];     /* the owner's own */
+    pool_block_t        *returned[POOL_CLASSES]; /* lock-free, newest first */
+    unsigned long       blocks;         /* made so far */
+} block_pool_t;
+
+block_pool_t command_pool;      /* owned by the thread reading input */
+
+/*
+ * A shard's message arena. Message blocks come in power-of-two
+ * size classes, MESSAGE_MIN bytes and up, each with a free list.
+ * The live blocks are interned: the intern table holds each
+ * distinct text once.
+ */
+#define MESSAGE_MIN     32
+#define MESSAGE_CLASSES 6               /* up to 1024 bytes */
+#define MESSAGE_CHUNK   16384
+
+typedef struct message_tag {
+    size_t              length;         /* of the text, less its '\0' */
+    unsigned int        hash;
+    unsigned int        refs;           /* alarms sharing it */
+    char                text[];         /* while free, the link */
+} message_t;
+
+typedef struct message_arena_tag {
+    message_t           *free[MESSAGE_CLASSES];
+    char                *chunk;         /* the part not yet handed out */
+    size_t              left;
+    unsigned long       chunks;
+    unsigned long       messages;       /* live (distinct) */
+    unsigned long       bytes;          /* in their blocks */
+    unsigned long       refs;           /* to them */
+    probe_table_t       interned;
+} message_arena_t;
+
+/*
+ * The alarm store is split into shards by alarm id. Each shard has
+ * its own mutex, indexes, deadline store, free list and timer
+ * thread, so commands on alarms in different shards, and the
+ * expiry of different shards, do not serialize on one lock. (The
+ * default is one shard per core; see -p.) Group state lives apart
+ * under the group_mutex, which may be taken while holding a shard
+ * mutex but never the other way round.
+ */
+typedef struct shard_tag {
+    pthread_mutex_t     mutex;
+    sched_t             sched;
+    alarm_index_t       alarm_index;    /* active alarms */
+    alarm_index_t       parked_index;   /* suspended alarms, not in the deadline store */
+    alarm_t             *pool;          /* free list */
+    unsigned long       pooled;         /* alarms on it */
+    unsigned long       slabs;          /* ALARM_SLAB alarms each */
+    block_pool_t        blocks;         /* fired alarms and message copies */
+    message_arena_t     arena;          /* alarm messages */
+    command_t           *inbox;         /* lock-free, newest first */
+    command_t           *backlog;       /* taken from the inbox, oldest first */
+    unsigned long       commands;       /* commands applied */
+    unsigned long       batches;        /* in this many batches */
+    group_change_t      *changes;       /* the batch's, not yet applied */
+    int                 change_count;
+    int                 change_size;
+    char                *output;        /* what they reported, not yet printed */
+    size_t              output_used;
+    size_t              output_size;
+    unsigned long       wakeups;        /* times the timer found alarms due */
+    unsigned long       fired;          /* alarms it fired */
+    probe_table_t       tallies;        /* ... by group; see group_tally */
+#ifdef ENGINE_TIMERFD
+    int                 timer_fd;       /* armed for the earliest deadline */
+    int                 wake_fd;        /* eventfd: the inbox has commands */
+    int                 pending;        /* the event loop owes it a pass */
+#else
+    pthread_cond_t      cond;           /* wakes its alarm thread only; CLOCK_MONOTONIC */
+    int                 sleeping;       /* its alarm thread is about to wait on cond */
+    pthread_t           thread;
+#endif
+} shard_t;
+
+shard_t *shards;
+int shard_count;
+
+shard_t *shard_of (int id)
+{
+    return &shards[(unsigned int)id % shard_count];
+}
+
+/*
+ * Registry of groups by id. Any non-negative id may be used, so
+ * rather than an array indexed by id, the group records are packed
+ * into a dense array (in no particular order, so a walk over every
+ * group touches only live records) and a hash table maps each id
+ * to its record's position. The table holds position + 1, so that
+ * no entry looks empty, and hashes an entry by the id of the record
+ * at that position. Removal moves the last record into the hole.
+ * Records move when the registry grows or shrinks, so a group_t
+ * pointer is only good until the next group_get or group_drop.
+ * All routines require that the caller have locked the group_mutex.
+ */
+typedef struct group_registry_tag {
+    group_t             *group;         /* dense records */
+    unsigned int        count;
+    unsigned int        capacity;
+    probe_table_t       table;          /* by id, to position + 1 */
+} group_registry_t;
+
+group_registry_t group_registry;
+
+#define GROUP_ENTRY(position)   ((void*)(uintptr_t)((position) + 1))
+#define GROUP_POSITION(entry)   ((uintptr_t)(entry) - 1)
+
+unsigned int group_hash (const void *entry)
+{
+    return id_hash (group_registry.group[GROUP_POSITION (entry)].id);
+}
+
+int group_match (const void *entry, const void *key)
+{
+    return group_registry.group[GROUP_POSITION (entry)].id == *(const int*)key;
+}
+
+group_t *group_find (group_registry_t *registry, int id)
+{
+    void *entry;
+
+    entry = probe_find (&registry->table, id_hash (id), group_match, &id);
+    return entry == NULL ? NULL : &registry->group[GROUP_POSITION (entry)];
+}
+
+/*
+ * Find a group, adding an empty record for it if there is none.
+ */
+group_t *group_get (group_registry_t *registry, int id)
+{
+    group_t *group;
+
+    if ((group = group_find (registry, id)) != NULL)
+        return group;
+    if (registry->count == registry->capacity) {
+        registry->capacity = registry->capacity ? registry->capacity * 2 : 64;
+        group = realloc (registry->group, registry->capacity * sizeof (group_t));
+        if (group == NULL)
+            errno_abort ("Grow group registry");
+        registry->group = group;
+    }
+    registry->group[registry->count] = (group_t){ .id = id };
+    probe_insert (&registry->table, GROUP_ENTRY (registry->count), group_hash);
+    return &registry->group[registry->count++];
+}
+
+void group_drop (group_registry_t *registry, group_t *group)
+{
+    unsigned int position = group - registry->group, last = registry->count - 1;
+
+    probe_remove (&registry->table, GROUP_ENTRY (position), group_hash);
+
+    // Keep the records dense: the last one fills the hole, and its table entry follows it
+    if (position != last) {
+        probe_remove (&registry->table, GROUP_ENTRY (last), group_hash);
+        registry->group[position] = registry->group[last];
+        probe_insert (&registry->table, GROUP_ENTRY (position), group_hash);
+    }
+    registry->count--;
+}
+
+/*
+ * Each shard counts the alarms it fires for each group id itself,
+ * under its own mutex, so firing never takes the group_mutex; a
+ * view adds the shards' counts up. A count is kept for as long as
+ * the program runs, so it covers every alarm ever fired for that
+ * group id.
+ */
+typedef struct group_tally_tag {
+    int                 id;
+    unsigned long       fired;
+} group_tally_t;
+
+unsigned int tally_hash (const void *entry)
+{
+    return id_hash (((const group_tally_t*)entry)->id);
+}
+
+int tally_match (const void *entry, const void *key)
+{
+    return ((const group_tally_t*)entry)->id == *(const int*)key;
+}
+
+/*
+ * Find a shard's count for a group, adding a zero count for it if
+ * there is none and "add" is set. The caller must hold the shard's
+ * mutex.
+ */
+group_tally_t *group_tally (shard_t *shard, int id, int add)
+{
+    group_tally_t *tally;
+
+    tally = probe_find (&shard->tallies, id_hash (id), tally_match, &id);
+    if (tally != NULL || !add)
+        return tally;
+    tally = (group_tally_t*)malloc (sizeof (group_tally_t));
+    if (tally == NULL)
+        errno_abort ("Allocate group tally");
+    tally->id = id;
+    tally->fired = 0;
+    probe_insert (&shard->tallies, tally, tally_hash);
+    return tally;
+}
+
+void handle_invalid_request() {
+    printf("Error: Invalid request format. Request discarded.\n");
+}
+void get_current_time(char *buffer, size_t size) {
+    time_t now = time(NULL);
+    struct tm local;  // localtime() shares one buffer between threads
+    strftime(buffer, size, "%Y-%m-%d %H:%M:%S", localtime_r(&now, &local));
+}
+
+/*
+ * Alarms are recycled through their shard's free list instead of
+ * going back to malloc, since many are cancelled shortly after
+ * being created. Only the shard's timer allocates and frees them
+ * (as it applies commands), so the list is in effect private to
+ * one thread. When it runs dry it is refilled with a whole slab of
+ * ALARM_SLAB alarms, cache line aligned, so malloc is called once
+ * per slab rather than once per alarm; slabs are never given back.
+ * Both routines require that the caller have locked the shard's
+ * mutex.
+ */
+#define ALARM_SLAB      256
+
+alarm_t *alarm_alloc (shard_t *shard)
+{
+    alarm_t *alarm = shard->pool;
+    void *slab;
+    int status;
+
+    if (alarm == NULL) {
+        status = posix_memalign (&slab, 64, ALARM_SLAB * sizeof (alarm_t));
+        if (status != 0)
+            err_abort (status, "Allocate alarm slab");
+        alarm = (alarm_t*)slab;
+        for (int i = 0; i < ALARM_SLAB - 1; i++)
+            alarm[i].sched_next = &alarm[i + 1];
+        alarm[ALARM_SLAB - 1].sched_next = NULL;
+        shard->pooled += ALARM_SLAB;
+        shard->slabs++;
+    }
+    shard->pool = alarm->sched_next;
+    shard->pooled--;
+    return alarm;
+}
+
+void alarm_free (shard_t *shard, alarm_t *alarm)
+{
+    alarm->sched_next = shard->pool;
+    shard->pool = alarm;
+    shard->pooled++;
+}
+
+/*
+ * Only a pool's owner allocates from it, first from its own free
+ * lists; any thread may free a block, by pushing it onto its
+ * class's "returned" stack without taking a lock. When the owner's
+ * list for a class runs dry it takes that stack whole, so there is
+ * no ABA problem, and only when both are empty is a block made with
+ * malloc. A block too big for the largest class goes to malloc and
+ * back every time.
+ */
+void *pool_alloc (block_pool_t *pool, size_t size)
+{
+    pool_block_t *block;
+    int class = 0;
+
+    while (((size_t)POOL_MIN << class) < sizeof (pool_block_t) + size)
+        class++;
+    if (class >= POOL_CLASSES) {
+        block = (pool_block_t*)malloc (sizeof (pool_block_t) + size);
+        if (block == NULL)
+            errno_abort ("Allocate block");
+        block->pool = NULL;
+        return block->data;
+    }
+    if ((block = pool->free[class]) == NULL)
+        block = __atomic_exchange_n (&pool->returned[class], NULL, __ATOMIC_ACQUIRE);
+    if (block == NULL) {
+        block = (pool_block_t*)malloc ((size_t)POOL_MIN << class);
+        if (block == NULL)
+            errno_abort ("Allocate block");
+        block->next = NULL;
+        block->pool = pool;
+        block->class = class;
+        pool->blocks++;
+    }
+    pool->free[class] = block->next;
+    return block->data;
+}
+
+void pool_free (void *data)
+{
+    pool_block_t *block;
+    pool_block_t **returned;
+
+    if (data == NULL)
+        return;
+    block = (pool_block_t*)((char*)data - offsetof (pool_block_t, data));
+    if (block->pool == NULL) {
+        free (block);
+        return;
+    }
+    returned = &block->pool->returned[block->class];
+    block->next = __atomic_load_n (returned, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (returned, &block->next,
+            block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Alarm messages may be of any length. Each is stored in a block
+ * from its shard's message arena, with its length in front; the
+ * blocks are carved from MESSAGE_CHUNK byte chunks in power-of-two
+ * size classes, and freed blocks go on their class's free list, so
+ * the arena never calls malloc for a message after warming up. A
+ * message too long for the largest class has a block of its own
+ * from malloc. As with the alarms themselves, only the shard's
+ * timer allocates and frees messages, and both routines require
+ * that the caller have locked the shard's mutex.
+ */
+int message_class (size_t length)
+{
+    size_t size = MESSAGE_MIN;
+    int class = 0;
+
+    while (size < sizeof (message_t) + length + 1) {
+        size *= 2;
+        class++;
+    }
+    return class;
+}
+
+char *message_alloc (shard_t *shard, const char *text, size_t length)
+{
+    message_arena_t *arena = &shard->arena;
+    message_t *block;
+    int class = message_class (length);
+    size_t size = (size_t)MESSAGE_MIN << class;
+
+    if (class >= MESSAGE_CLASSES) {
+        block = (message_t*)malloc (size);
+        if (block == NULL)
+            errno_abort ("Allocate message");
+    } else if ((block = arena->free[class]) != NULL) {
+        arena->free[class] = *(message_t**)block->text;
+    } else {
+        /*
+         * Carve a new block; what is left of a chunk too short for
+         * it is abandoned.
+         */
+        if (arena->left < size) {
+            arena->chunk = (char*)malloc (MESSAGE_CHUNK);
+            if (arena->chunk == NULL)
+                errno_abort ("Allocate message chunk");
+            arena->left = MESSAGE_CHUNK;
+            arena->chunks++;
+        }
+        block = (message_t*)arena->chunk;
+        arena->chunk += size;
+        arena->left -= size;
+    }
+    block->length = length;
+    memcpy (block->text, text, length);
+    block->text[length] = '\0';
+    arena->messages++;
+    arena->bytes += size;
+    return block->text;
+}
+
+message_t *message_block (const char *text)
+{
+    return (message_t*)(text - offsetof (message_t, text));
+}
+
+size_t message_length (const char *text)
+{
+    return message_block (text)->length;
+}
+
+void message_free (shard_t *shard, char *text)
+{
+    message_arena_t *arena = &shard->arena;
+    message_t *block = message_block (text);
+    int class = message_class (block->length);
+
+    arena->messages--;
+    arena->bytes -= (size_t)MESSAGE_MIN << class;
+    if (class >= MESSAGE_CLASSES) {
+        free (block);
+        return;
+    }
+    *(message_t**)block->text = arena->free[class];
+    arena->free[class] = block;
+}
+
+/*
+ * Alarms with the same message share one block, which counts them
+ * in its refs. Giving an alarm a message is a lookup in the intern
+ * table and, if the text is already there, a pointer store; the
+ * block goes back to the arena when its last alarm lets go of it.
+ * Both routines require that the caller have locked the shard's
+ * mutex.
+ */
+unsigned int message_hash (const char *text, size_t length)
+{
+    unsigned int hash = 2166136261u;    /* FNV-1a */
+
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    return hash;
+}
+
+/*
+ * What a lookup in the intern table compares blocks with.
+ */
+typedef struct message_key_tag {
+    const char          *text;
+    size_t              length;
+    unsigned int        hash;
+} message_key_t;
+
+unsigned int message_entry_hash (const void *entry)
+{
+    return ((const message_t*)entry)->hash;
+}
+
+int message_match (const void *entry, const void *key)
+{
+    const message_t *block = entry;
+    const message_key_t *message = key;
+
+    return block->hash == message->hash && block->length == message->length
+        && memcmp (block->text, message->text, message->length) == 0;
+}
+
+char *message_intern (shard_t *shard, const char *text, size_t length)
+{
+    message_arena_t *arena = &shard->arena;
+    message_key_t key = {text, length, message_hash (text, length)};
+    message_t *block;
+
+    block = probe_find (&arena->interned, key.hash, message_match, &key);
+    if (block == NULL) {
+        block = message_block (message_alloc (shard, text, length));
+        block->hash = key.hash;
+        block->refs = 0;
+        probe_insert (&arena->interned, block, message_entry_hash);
+    }
+    block->refs++;
+    arena->refs++;
+    return block->text;
+}
+
+void message_release (shard_t *shard, char *text)
+{
+    message_arena_t *arena = &shard->arena;
+    message_t *block = message_block (text);
+
+    arena->refs--;
+    if (--block->refs > 0)
+        return;
+    probe_remove (&arena->interned, block, message_entry_hash);
+    message_free (shard, text);
+}
+
+/*
+ * Append a fired alarm to a worker's deque and wake the worker. If
+ * that leaves it a backlog, wake one idle worker to steal from it.
+ */
+void worker_push (worker_t *worker, fired_t *fired)
+{
+    fired_t **deque;
+    int status, backlog, i;
+    worker_t *thief;
+
+    status = pthread_mutex_lock (&worker->mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    if (worker->count == worker->size) {
+        deque = malloc ((worker->size ? worker->size * 2 : 64) * sizeof (fired_t*));
+        if (deque == NULL)
+            errno_abort ("Grow display deque");
+        for (i = 0; i < worker->count; i++)
+            deque[i] = worker->deque[(worker->head + i) % worker->size];
+        free (worker->deque);
+        worker->deque = deque;
+        worker->head = 0;
+        worker->size = worker->size ? worker->size * 2 : 64;
+    }
+    worker->deque[(worker->head + worker->count++) % worker->size] = fired;
+    backlog = worker->count > 1;
+    status = pthread_cond_signal (&worker->ready);
+    if (status != 0)
+        err_abort (status, "Signal cond");
+    pthread_mutex_unlock (&worker->mutex);
+
+    if (!backlog || ordered)
+        return;
+    for (i = 0; i < worker_count; i++) {
+        thief = &workers[i];
+        if (thief == worker || !__atomic_load_n (&thief->idle, __ATOMIC_SEQ_CST))
+            continue;
+        status = pthread_mutex_lock (&thief->mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        thief->kicked = 1;
+        status = pthread_cond_signal (&thief->ready);
+        if (status != 0)
+            err_abort (status, "Signal cond");
+        pthread_mutex_unlock (&thief->mutex);
+        break;
+    }
+}
+
+/*
+ * Take the oldest entry from a worker's own deque, or NULL.
+ */
+fired_t *worker_pop (worker_t *worker)
+{
+    fired_t *fired = NULL;
+    int status;
+
+    status = pthread_mutex_lock (&worker->mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    if (worker->count > 0) {
+        fired = worker->deque[worker->head];
+        worker->head = (worker->head + 1) % worker->size;
+        worker->count--;
+    }
+    pthread_mutex_unlock (&worker->mutex);
+    return fired;
+}
+
+/*
+ * Take the newest entry from some other worker's deque, or NULL.
+ */
+fired_t *worker_steal (worker_t *worker)
+{
+    fired_t *fired = NULL;
+    worker_t *victim;
+    int status, i;
+
+    for (i = 1; i < worker_count && fired == NULL; i++) {
+        victim = &workers[(worker - workers + i) % worker_count];
+        status = pthread_mutex_lock (&victim->mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        if (victim->count > 0) {
+            victim->count--;
+            fired = victim->deque[(victim->head + victim->count) % victim->size];
+        }
+        pthread_mutex_unlock (&victim->mutex);
+    }
+    return fired;
+}
+
+/*
+ * Hand a fired alarm to its group's home worker. The alarm carries
+ * its home (see group_apply), and the shard counts what it fires,
+ * so this never touches group state.
+ */
+void alarm_fire (shard_t *shard, alarm_t *alarm, long long skipped)
+{
+    fired_t *fired;
+    size_t length;
+
+    /*
+     * LOCKING PROTOCOL:
+     * 
+     * This routine requires that the caller have locked the
+     * alarm's shard mutex!
+     */
+    length = message_length (alarm->message);
+    fired = (fired_t*)pool_alloc (&shard->blocks, sizeof (fired_t) + length + 1);
+    fired->id = alarm->id;
+    fired->groupId = alarm->groupId;
+    fired->period = alarm->period;
+    fired->skipped = skipped;
+    memcpy (fired->message, alarm->message, length + 1);
+
+    group_tally (shard, alarm->groupId, 1)->fired++;
+    worker_push (alarm->worker, fired);
+}
+
+/*
+ * Queue an event for a group thread and wake it. The thread owns
+ * the event's message from here on.
+ */
+void channel_post (channel_t *channel, const group_event_t *event)
+{
+    group_event_t *ring;
+    int status, i;
+
+    /*
+     * LOCKING PROTOCOL:
+     * 
+     * This routine requires that the caller have locked the
+     * group_mutex!
+     */
+    if (channel->count == channel->size) {
+        ring = malloc ((channel->size ? channel->size * 2 : 64) * sizeof (group_event_t));
+        if (ring == NULL)
+            errno_abort ("Grow group channel");
+        for (i = 0; i < channel->count; i++)
+            ring[i] = channel->event[(channel->head + i) % channel->size];
+        free (channel->event);
+        channel->event = ring;
+        channel->head = 0;
+        channel->size = channel->size ? channel->size * 2 : 64;
+    }
+    channel->event[(channel->head + channel->count++) % channel->size] = *event;
+
+    /*
+     * The thread only waits on an empty queue, so only the first
+     * event of a batch needs to wake it.
+     */
+    if (channel->count > 1)
+        return;
+    status = pthread_cond_signal (&channel->cond);
+    if (status != 0)
+        err_abort (status, "Signal cond");
+}
+
+/*
+ * Wait for the next event on a channel and take it.
+ */
+void channel_wait (channel_t *channel, group_event_t *event)
+{
+    int status;
+
+    /*
+     * LOCKING PROTOCOL:
+     * 
+     * This routine requires that the caller have locked the
+     * group_mutex!
+     */
+    while (channel->count == 0) {
+        status = pthread_cond_wait (&channel->cond, &group_mutex);
+        if (status != 0)
+            err_abort (status, "Wait on cond");
+    }
+    *event = channel->event[channel->head];
+    channel->head = (channel->head + 1) % channel->size;
+    channel->count--;
+}
+
+/*
+ * Record a group change for the end of the batch.
+ */
+group_change_t *group_change (shard_t *shard, alarm_t *alarm, int delta)
+{
+    group_change_t *change;
+
+    /*
+     * LOCKING PROTOCOL:
+     * 
+     * This routine requires that the caller have locked the
+     * alarm's shard mutex!
+     */
+    if (shard->change_count == shard->change_size) {
+        change = realloc (shard->changes,
+            (shard->change_size ? shard->change_size * 2 : 64) * sizeof (group_change_t));
+        if (change == NULL)
+            errno_abort ("Grow group changes");
+        shard->changes = change;
+        shard->change_size = shard->change_size ? shard->change_size * 2 : 64;
+    }
+    change = &shard->changes[shard->change_count++];
+    change->delta = delta;
+    change->event = (group_event_t){
+        .alarmId = alarm->id,
+        .groupId = alarm->groupId,
+        .period = alarm->period,
+    };
+    return change;
+}
+
+/*
+ * Count an active alarm into its group, once the batch is done.
+ * The message is copied for the creation thread now, while the
+ * group_mutex is not held.
+ */
+void group_join (shard_t *shard, alarm_t *alarm)
+{
+    group_change_t *change;
+    size_t length;
+
+    change = group_change (shard, alarm, 1);
+    length = message_length (alarm->message);
+    change->event.message = pool_alloc (&shard->blocks, length + 1);
+    memcpy (change->event.message, alarm->message, length + 1);
+}
+
+/*
+ * Count an active alarm out of its group, once the batch is done.
+ */
+void group_leave (shard_t *shard, alarm_t *alarm)
+{
+    group_change (shard, alarm, -1);
+}
+
+/*
+ * Carry out the group changes a shard's batch recorded, in order,
+ * under one hold of the group_mutex. A group without a display
+ * worker is given the least loaded one when an alarm joins it,
+ * rather than by the creation thread later, so that every alarm
+ * the group fires goes to that one home and, with -o, prints in
+ * order; the creation thread is told of every join, to log it.
+ * The removal thread is told only when a group is left with no
+ * active alarms.
+ */
+void group_apply (shard_t *shard)
+{
+    group_change_t *change;
+    group_t *group;
+    alarm_t *alarm;
+    int status;
+
+    /*
+     * LOCKING PROTOCOL:
+     * 
+     * This routine requires that the caller have locked the
+     * shard's mutex! It locks the group_mutex itself.
+     */
+    if (shard->change_count == 0)
+        return;
+    status = pthread_mutex_lock (&group_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    for (change = shard->changes;
+            change < &shard->changes[shard->change_count]; change++) {
+        if (change->delta > 0) {
+            group = group_get (&group_registry, change->event.groupId);
+            group->alarms++;
+            if (group->worker == NULL) {
+                group->worker = &workers[0];
+                for (int i = 1; i < worker_count; i++)
+                    if (workers[i].groups < group->worker->groups)
+                        group->worker = &workers[i];
+                group->worker->groups++;
+                change->event.assigned = 1;
+            }
+            change->event.worker = group->worker;
+            channel_post (&creation_channel, &change->event);
+
+            /*
+             * Give the alarm its home, unless it has been suspended
+             * or moved since (that will have its own change). The
+             * home stays put while the group has active alarms.
+             */
+            alarm = index_lookup (&shard->alarm_index, change->event.alarmId);
+            if (alarm != NULL && alarm->groupId == change->event.groupId)
+                alarm->worker = group->worker;
+        } else if (--group_find (&group_registry, change->event.groupId)->alarms == 0)
+            channel_post (&removal_channel, &change->event);
+    }
+    pthread_mutex_unlock (&group_mutex);
+    shard->change_count = 0;
+}
+
+/*
+ * Wake whatever is running a shard's timer, because its inbox has
+ * something in it. The timer applies commands itself, and looks at
+ * its deadline store after every batch, so nothing else needs to
+ * wake it.
+ */
+void timer_wake (shard_t *shard)
+{
+#ifdef ENGINE_TIMERFD
+    if (eventfd_write (shard->wake_fd, 1) != 0 && errno != EAGAIN)
+        errno_abort ("Write eventfd");
+#else
+    int status;
+
+    status = pthread_cond_signal (&shard->cond);
+    if (status != 0)
+        err_abort (status, "Signal cond");
+#endif
+}
+
+/*
+ * Insert alarm entry into its shard's deadline store.
+ */
+void alarm_insert (shard_t *shard, alarm_t *alarm)
+{
+    /*
+     * LOCKING PROTOCOL:
+     * 
+     * This routine requires that the caller have locked the
+     * shard's mutex!
+     */
+    sched_link (&shard->sched, alarm);
+#ifdef DEBUG
+    printf ("[sched: alarm %d due %lld in slot %d]\n",
+        alarm->id, alarm_tick (alarm), alarm->sched_slot);
+#endif
+}
+
+/*
+ * Remove alarm entry from its shard's deadline store.
+ */
+void alarm_remove (shard_t *shard, alarm_t *alarm)
+{
+    /*
+     * LOCKING PROTOCOL:
+     * 
+     * This routine requires that the caller have locked the
+     * shard's mutex!
+     */
+    if (alarm->sched_slot < 0)
+        return;
+    sched_unlink (&shard->sched, alarm);
+}
+
+/*
+ * Give a scheduled alarm a new deadline, moving it within the
+ * deadline store rather than removing and re-inserting it.
+ */
+void alarm_rekey (shard_t *shard, alarm_t *alarm, long long deadline)
+{
+    /*
+     * LOCKING PROTOCOL:
+     * 
+     * This routine requires that the caller have locked the
+     * shard's mutex!
+     */
+    alarm->deadline = deadline;
+    if (alarm->sched_slot < 0)
+        return;
+    sched_rekey (&shard->sched, alarm);
+}
+
+/*
+ * Find an alarm by id, whether active or suspended, and optionally
+ * report which of its shard's indexes holds it. The caller must
+ * hold the shard's mutex.
+ */
+alarm_t *find_alarm(shard_t *shard, int id, alarm_index_t **index) {
+    alarm_t *alarm = index_lookup(&shard->alarm_index, id);
+    alarm_index_t *found = &shard->alarm_index;
+
+    if (!alarm) {
+        alarm = index_lookup(&shard->parked_index, id);
+        found = &shard->parked_index;
+    }
+    if (index)
+        *index = found;
+    return alarm;
+}
+
+/*
+ * Rather than print while holding the shard's mutex, the command
+ * routines append what they report to the shard's output buffer,
+ * which the timer writes out with shard_flush once it has let the
+ * mutex go. Only the shard's timer touches the buffer.
+ */
+void shard_print (shard_t *shard, const char *format, ...)
+{
+    va_list args;
+    char *output;
+    int length;
+
+    while (1) {
+        if (shard->output_size - shard->output_used > 1) {
+            va_start (args, format);
+            length = vsnprintf (shard->output + shard->output_used,
+                shard->output_size - shard->output_used, format, args);
+            va_end (args);
+            if (length < 0)
+                errno_abort ("Format output");
+            if ((size_t)length < shard->output_size - shard->output_used) {
+                shard->output_used += length;
+                return;
+            }
+        }
+        output = realloc (shard->output, shard->output_size ? shard->output_size * 2 : 4096);
+        if (output == NULL)
+            errno_abort ("Grow output buffer");
+        shard->output = output;
+        shard->output_size = shard->output_size ? shard->output_size * 2 : 4096;
+    }
+}
+
+void shard_flush (shard_t *shard)
+{
+    if (shard->output_used == 0)
+        return;
+    fwrite (shard->output, 1, shard->output_used, stdout);
+    fflush (stdout);
+    shard->output_used = 0;
+}
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * The command routines below are applied by a shard's alarm thread
+ * as it drains the shard's inbox (see command_drain), so each
+ * requires that the caller have locked the mutex of the shard that
+ * owns the alarm id. They record what they do to groups with
+ * group_join and group_leave, for group_apply to carry out after
+ * the batch, and report through shard_print, so nothing is printed
+ * while the mutex is held.
  */
-typedef struct alarm_tag {
-    struct alarm_tag    *link;
-    int                 seconds;
-    time_t              time;   /* seconds from EPOCH */
-    char                message[64];
-    int                 id;
-    int                 groupId;
-} alarm_t;
+void insert_alarm(int id, int groupId, long long period, const char *message, pthread_t source) {
+    shard_t *shard = shard_of(id);
 
-// Global array to track which groups have an active display thread
-#define MAX_GROUPS 256  // Maximum number of groups that can be tracked
-int active_group_threads[MAX_GROUPS] = {0};  // 0 means no thread, 1 means a thread exists
+    // Alarm ids are unique; the indexes find an existing one in O(1)
+    if (find_alarm(shard, id, NULL) != NULL) {
+        shard_print(shard, "Error: Alarm(%d) already exists. Request discarded.\n", id);
+        return;
+    }
 
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
-time_t current_alarm = 0;
+    alarm_t *new_alarm = alarm_alloc(shard);
 
+    // Initialize the new alarm
+    new_alarm->id = id;
+    new_alarm->groupId = groupId;
+    new_alarm->period = period;
+    new_alarm->deadline = current_tick() + period;  // First due one period from now
+    new_alarm->message = message_intern(shard, message, strlen(message));
+    new_alarm->sched_next = new_alarm->sched_prev = NULL;
+    new_alarm->sched_slot = -1;
+    index_insert(&shard->alarm_index, new_alarm);
 
-void handle_invalid_request() {
-    printf("Error: Invalid request format. Request discarded.\n");
+    // Schedule its first expiry with the alarm thread, and give its group a display thread
+    alarm_insert(shard, new_alarm);
+    group_join(shard, new_alarm);
+
+    // Print confirmation message
+    char time_buffer[64], period_buffer[32];
+    get_current_time(time_buffer, sizeof(time_buffer));
+    shard_print(shard, "Alarm(%d) Inserted by Main Thread %ld Into Alarm List at %s: Group(%d) %s %s\n",
+           id, source, time_buffer, groupId,
+           format_duration(period, period_buffer, sizeof(period_buffer)), new_alarm->message);
 }
-void get_current_time(char *buffer, size_t size) {
-    time_t now = time(NULL);
-    strftime(buffer, size, "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+void change_alarm(int id, int groupId, long long period, const char *message) {
+    shard_t *shard = shard_of(id);
+    alarm_index_t *index;
+
+    alarm_t *alarm = find_alarm(shard, id, &index);
+    if (!alarm) {
+        shard_print(shard, "Error: Alarm(%d) does not exist. Request discarded.\n", id);
+        return;
+    }
+
+    // Update the alarm in place instead of freeing and re-inserting it;
+    // an active alarm moving to another group is counted out of the old one and into the new
+    int moved = alarm->groupId != groupId && index == &shard->alarm_index;
+    if (moved)
+        group_leave(shard, alarm);
+    alarm->groupId = groupId;
+    char *old_message = alarm->message;  // Interning first keeps an unchanged text's block alive
+    alarm->message = message_intern(shard, message, strlen(message));
+    message_release(shard, old_message);
+
+    // Only a new period moves the alarm in the deadline store
+    if (alarm->period != period) {
+        alarm->period = period;
+        if (index == &shard->parked_index)
+            alarm->deadline = period;  // A full new period once reactivated
+        else
+            alarm_rekey(shard, alarm, current_tick() + period);
+    }
+    if (moved)
+        group_join(shard, alarm);
+
+    char time_buffer[64], period_buffer[32];
+    get_current_time(time_buffer, sizeof(time_buffer));
+    shard_print(shard, "Alarm(%d) Changed at %s: Group(%d) %s %s\n",
+           id, time_buffer, groupId,
+           format_duration(period, period_buffer, sizeof(period_buffer)), alarm->message);
 }
 
-void insert_alarm(int id, int groupId, int seconds, const char *message) {
-    
-    alarm_t *new_alarm = (alarm_t *)malloc(sizeof(alarm_t));
-    if (!new_alarm) {
-        fprintf(stderr, "Error: Memory allocation failed\n");
+void cancel_alarm(int id) {
+    shard_t *shard = shard_of(id);
+    alarm_index_t *index;
+
+    alarm_t *alarm = find_alarm(shard, id, &index);
+    if (!alarm) {
+        shard_print(shard, "Error: Alarm(%d) does not exist. Request discarded.\n", id);
         return;
     }
 
-    // Initialize the new alarm
-    new_alarm->id = id;
-    new_alarm->groupId = groupId;
-    new_alarm->seconds = seconds;
-    new_alarm->time = time(NULL) + seconds;  // Alarm time is seconds from now
-    strncpy(new_alarm->message, message, sizeof(new_alarm->message) - 1);
-    new_alarm->message[sizeof(new_alarm->message) - 1] = '\0'; // Ensure null-termination
-    new_alarm->link = NULL;
-
-    // Lock the mutex to safely modify the alarm list
-    pthread_mutex_lock(&alarm_mutex);
-
-    // Insert the new alarm in the list in sorted order by id
-    if (!alarm_list || alarm_list->id > id) {
-        new_alarm->link = alarm_list;
-        alarm_list = new_alarm;  // If the list is empty or this alarm has a smaller id, insert at the front
-    } else {
-        alarm_t *current = alarm_list;
-        while (current->link && current->link->id < id) {
-            current = current->link;  // Traverse the list to find the right spot
-        }
-        new_alarm->link = current->link;
-        current->link = new_alarm;  // Insert the new alarm in the correct spot
+    // Unlink it from its index and the deadline store; no list walk needed
+    index_remove(index, alarm);
+    alarm_remove(shard, alarm);
+    if (index == &shard->alarm_index)
+        group_leave(shard, alarm);
+
+    char time_buffer[64], period_buffer[32];
+    get_current_time(time_buffer, sizeof(time_buffer));
+    shard_print(shard, "Alarm(%d) Canceled at %s: Group(%d) %s %s\n",
+           id, time_buffer, alarm->groupId,
+           format_duration(alarm->period, period_buffer, sizeof(period_buffer)), alarm->message);
+
+    message_release(shard, alarm->message);
+    alarm_free(shard, alarm);
+}
+
+void suspend_alarm(int id) {
+    shard_t *shard = shard_of(id);
+
+    alarm_t *alarm = index_lookup(&shard->alarm_index, id);
+    if (!alarm) {
+        shard_print(shard, "Error: Alarm(%d) is not active. Request discarded.\n", id);
+        return;
     }
 
-    // Unlock the mutex
-    pthread_mutex_unlock(&alarm_mutex);
+    /*
+     * Park the alarm: it leaves the deadline store and the active
+     * index, so neither the alarm thread nor the display threads
+     * see it until it is reactivated. Keep the time it had left.
+     */
+    long long remaining = alarm->deadline - current_tick();
+    index_remove(&shard->alarm_index, alarm);
+    alarm_remove(shard, alarm);
+    alarm->deadline = remaining > 0 ? remaining : 0;
+    index_insert(&shard->parked_index, alarm);
+    group_leave(shard, alarm);
 
-    // Print confirmation message
-    char time_buffer[64];
+    char time_buffer[64], period_buffer[32];
     get_current_time(time_buffer, sizeof(time_buffer));
-    printf("Alarm(%d) Inserted by Main Thread %ld Into Alarm List at %s: Group(%d) %d %s\n",
-           id, pthread_self(), time_buffer, groupId, seconds, new_alarm->message);
+    shard_print(shard, "Alarm(%d) Suspended at %s: Group(%d) %s %s\n",
+           id, time_buffer, alarm->groupId,
+           format_duration(alarm->period, period_buffer, sizeof(period_buffer)), alarm->message);
 }
 
+void reactivate_alarm(int id) {
+    shard_t *shard = shard_of(id);
+
+    alarm_t *alarm = index_lookup(&shard->parked_index, id);
+    if (!alarm) {
+        shard_print(shard, "Error: Alarm(%d) is not suspended. Request discarded.\n", id);
+        return;
+    }
+
+    // Resume with whatever time it had left when it was suspended
+    index_remove(&shard->parked_index, alarm);
+    alarm->deadline = current_tick() + alarm->deadline;
+    index_insert(&shard->alarm_index, alarm);
+    alarm_insert(shard, alarm);
+
+    // Its group may need a display thread again
+    group_join(shard, alarm);
+
+    char time_buffer[64], period_buffer[32];
+    get_current_time(time_buffer, sizeof(time_buffer));
+    shard_print(shard, "Alarm(%d) Reactivated at %s: Group(%d) %s %s\n",
+           id, time_buffer, alarm->groupId,
+           format_duration(alarm->period, period_buffer, sizeof(period_buffer)), alarm->message);
+}
 
 /*
- * Insert alarm entry on list, in order.
+ * Hand a command to the shard that owns its alarm. Any number of
+ * threads may submit at once: the inbox is a lock-free stack that
+ * the shard's alarm thread takes whole, so there is no ABA problem,
+ * and only a push onto an empty inbox can need to wake the thread.
+ * Even that takes the shard's mutex only if the thread has said it
+ * is about to sleep; a busy thread looks at its inbox again before
+ * it does, so submitters never wait for it to finish firing alarms
+ * or applying a batch.
  */
-void alarm_insert (alarm_t *alarm)
+void command_submit (command_t *command)
 {
+    shard_t *shard = shard_of (command->id);
+    command_t *head;
+
+    /*
+     * Once pushed, the command belongs to the alarm thread, so
+     * whether the inbox was empty is judged from a local copy.
+     */
+    head = __atomic_load_n (&shard->inbox, __ATOMIC_RELAXED);
+    do
+        command->next = head;
+    while (!__atomic_compare_exchange_n (&shard->inbox, &head,
+            command, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    if (head != NULL)
+        return;
+#ifdef ENGINE_TIMERFD
+    timer_wake (shard);
+#else
     int status;
-    alarm_t **last, *next;
+
+    /*
+     * The alarm thread sets "sleeping" under its mutex and then
+     * looks at the inbox; we pushed and then look at "sleeping".
+     * Both are sequentially consistent, so one of us sees the
+     * other. If it is asleep, or about to be, signal under the
+     * mutex, which it holds until the wait lets it go, so the
+     * wakeup cannot fall between its look and its wait.
+     */
+    if (!__atomic_load_n (&shard->sleeping, __ATOMIC_SEQ_CST))
+        return;
+    status = pthread_mutex_lock (&shard->mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    timer_wake (shard);
+    pthread_mutex_unlock (&shard->mutex);
+#endif
+}
+
+/*
+ * Apply the next batch of a shard's commands, oldest first: up to
+ * batch_size of them, with their group changes applied together at
+ * the end. The caller, the shard's timer, looks at its deadline
+ * store afterwards. The inbox is only taken once the previous
+ * take has been used up, which keeps commands in arrival order.
+ * Returns nonzero if commands are left over for another batch, so
+ * the timer can fire what is due in between.
+ */
+int command_drain (shard_t *shard)
+{
+    command_t *command, *next;
+    int applied;
 
     /*
      * LOCKING PROTOCOL:
      * 
      * This routine requires that the caller have locked the
-     * alarm_mutex!
+     * shard's mutex!
      */
-    last = &alarm_list;
-    next = *last;
-    while (next != NULL) {
-        if (next->time >= alarm->time) {
-            alarm->link = next;
-            *last = alarm;
+    if (shard->backlog == NULL) {
+        command = __atomic_exchange_n (&shard->inbox, NULL, __ATOMIC_ACQUIRE);
+        while (command != NULL) {
+            next = command->next;
+            command->next = shard->backlog;
+            shard->backlog = command;
+            command = next;
+        }
+        if (shard->backlog == NULL)
+            return 0;
+    }
+
+    for (applied = 0; applied < batch_size
+            && (command = shard->backlog) != NULL; applied++) {
+        shard->backlog = command->next;
+        switch (command->type) {
+        case CMD_START:
+            insert_alarm (command->id, command->groupId, command->period,
+                command->message, command->source);
+            break;
+        case CMD_CHANGE:
+            change_alarm (command->id, command->groupId, command->period,
+                command->message);
+            break;
+        case CMD_CANCEL:
+            cancel_alarm (command->id);
+            break;
+        case CMD_SUSPEND:
+            suspend_alarm (command->id);
+            break;
+        case CMD_REACTIVATE:
+            reactivate_alarm (command->id);
             break;
         }
-        last = &next->link;
-        next = next->link;
+        pool_free (command);
     }
+    group_apply (shard);
+    shard->commands += applied;
+    shard->batches++;
+
     /*
-     * If we reached the end of the list, insert the new alarm
-     * there.  ("next" is NULL, and "last" points to the link
-     * field of the last item, or to the list header.)
+     * Commands pushed during the batch are waiting in the inbox,
+     * which the take above left empty; count them as left over, so
+     * the caller comes straight back for them.
      */
-    if (next == NULL) {
-        *last = alarm;
-        alarm->link = NULL;
+    return shard->backlog != NULL
+        || __atomic_load_n (&shard->inbox, __ATOMIC_ACQUIRE) != NULL;
+}
+
+void view_timer_stats() {
+    unsigned long wakeups = 0, fired = 0, commands = 0, batches = 0;
+    unsigned long pooled = 0, slabs = 0, messages = 0, bytes = 0, chunks = 0, refs = 0;
+    unsigned long blocks = command_pool.blocks;
+    long long next = -1;
+
+    // Visit the shards one at a time; the earliest of their next deadlines is the global one
+    for (int i = 0; i < shard_count; i++) {
+        shard_t *shard = &shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        long long due = sched_next(&shard->sched);
+        if (due >= 0 && (next < 0 || due < next))
+            next = due;
+        wakeups += shard->wakeups;
+        fired += shard->fired;
+        commands += shard->commands;
+        batches += shard->batches;
+        pooled += shard->pooled;
+        slabs += shard->slabs;
+        blocks += shard->blocks.blocks;
+        messages += shard->arena.messages;
+        bytes += shard->arena.bytes;
+        chunks += shard->arena.chunks;
+        refs += shard->arena.refs;
+        pthread_mutex_unlock(&shard->mutex);
     }
-#ifdef DEBUG
-    printf ("[list: ");
-    for (next = alarm_list; next != NULL; next = next->link)
-        printf ("%d(%d)[\"%s\"] ", next->time,
-            next->time - time (NULL), next->message);
-    printf ("]\n");
-#endif
+
+    // Fired per wakeup above 1 is what the slack is buying
+    char slack_buffer[32];
+    printf("Alarm Threads: %d shards, %lu wakeups, %lu alarms fired, slack %s\n",
+           shard_count, wakeups, fired,
+           timer_slack > 0 ? format_duration(timer_slack, slack_buffer, sizeof(slack_buffer)) : "0");
+    printf("Commands Applied: %lu in %lu batches of up to %d\n", commands, batches, batch_size);
+    printf("Alarm Pool: %lu in use, %lu free, %lu slabs of %d\n",
+           slabs * ALARM_SLAB - pooled, pooled, slabs, ALARM_SLAB);
+    printf("Block Pools: %lu blocks made for commands and fired alarms\n", blocks);
+    printf("Message Arena: %lu messages, %lu distinct in %lu bytes, %lu chunks of %d\n",
+           refs, messages, bytes, chunks, MESSAGE_CHUNK);
+    if (next < 0) {
+        printf("Next Alarm Due: none\n");
+    } else {
+        long long wait = next - current_tick();
+        char wait_buffer[32];
+        printf("Next Alarm Due in %s seconds\n",
+               wait > 0 ? format_duration(wait, wait_buffer, sizeof(wait_buffer)) : "0");
+    }
+}
+
+void view_groups() {
+    // Copy the registry's dense records, so the shards can be visited without the group_mutex
+    pthread_mutex_lock(&group_mutex);
+    unsigned int count = group_registry.count;
+    group_t *group = malloc((count ? count : 1) * sizeof(group_t));
+    if (group == NULL)
+        errno_abort("Copy groups");
+    memcpy(group, group_registry.group, count * sizeof(group_t));
+    pthread_mutex_unlock(&group_mutex);
+
+    printf("Alarm Groups: %u\n", count);
+    for (unsigned int i = 0; i < count; i++) {
+        // Each shard counts what it fired for the group
+        unsigned long fired = 0;
+        for (int j = 0; j < shard_count; j++) {
+            pthread_mutex_lock(&shards[j].mutex);
+            group_tally_t *tally = group_tally(&shards[j], group[i].id, 0);
+            if (tally != NULL)
+                fired += tally->fired;
+            pthread_mutex_unlock(&shards[j].mutex);
+        }
+        printf("  Group(%d): %d Active Alarms, %lu Fired, Display Alarm Thread %ld\n",
+               group[i].id, group[i].alarms, fired,
+               group[i].worker ? (long)group[i].worker->thread : 0L);
+    }
+    free(group);
+}
+
+
+/*
+ * Bring a shard's deadline store up to the current time. Each
+ * expired alarm is handed to its group's display worker and
+ * re-armed for its next period. Returns the tick the shard's timer
+ * should next wake at, or -1 if the store is empty.
+ */
+long long alarm_expire (shard_t *shard)
+{
+    alarm_t *alarm, *expired;
+    long long next, now, skipped;
+
+    /*
+     * LOCKING PROTOCOL:
+     * 
+     * This routine requires that the caller have locked the
+     * shard's mutex!
+     */
+    now = current_tick ();
+    expired = sched_advance (&shard->sched, now);
+
     /*
-     * Wake the alarm thread if it is not busy (that is, if
-     * current_alarm is 0, signifying that it's waiting for
-     * work), or if the new alarm comes before the one on
-     * which the alarm thread is waiting.
+     * The timer also comes through here after every batch of
+     * commands, so count only the passes that found alarms due:
+     * those are the wakeups that timer slack sets out to share.
      */
-    if (current_alarm == 0 || alarm->time < current_alarm) {
-        current_alarm = alarm->time;
-        status = pthread_cond_signal (&alarm_cond);
-        if (status != 0)
-            err_abort (status, "Signal cond");
+    if (expired != NULL)
+        shard->wakeups++;
+    while (expired != NULL) {
+        alarm = expired;
+        expired = alarm->sched_next;
+
+        /*
+         * Re-arm from the deadline it was due at rather than from
+         * now, so lateness does not accumulate and the alarm stays
+         * in phase. Periods that have already gone by entirely are
+         * skipped, and reported with this firing, instead of fired
+         * in a burst.
+         */
+        skipped = 0;
+        alarm->deadline += alarm->period;
+        if (alarm->deadline <= now) {
+            skipped = (now - alarm->deadline) / alarm->period + 1;
+            alarm->deadline += skipped * alarm->period;
+        }
+        alarm_fire (shard, alarm, skipped);
+        sched_link (&shard->sched, alarm);
+        shard->fired++;
     }
+
+    /*
+     * As with Linux timer slack, the earliest alarm may fire up
+     * to timer_slack late, so that any others falling due within
+     * that window are fired by the same wakeup.
+     */
+    next = sched_next (&shard->sched);
+    if (next < 0)
+        return -1;
+#ifdef DEBUG
+    printf ("[shard %d waiting: %lld(%lld)]\n",
+        (int)(shard - shards), next, next - now);
+#endif
+    return next + timer_slack;
 }
 
+#ifndef ENGINE_TIMERFD
 /*
- * The alarm thread's start routine.
+ * The alarm thread's start routine. Each shard has one, and "arg"
+ * is its shard.
  */
 void *alarm_thread (void *arg)
 {
-    alarm_t *alarm;
+    shard_t *shard = (shard_t*)arg;
     struct timespec cond_time;
-    time_t now;
-    int status, expired;
-    pthread_t thread;
+    long long next;
+    int status, backlog;
+
     /*
      * Loop forever, processing commands. The alarm thread will
      * be disintegrated when the process exits. Lock the mutex
      * at the start -- it will be unlocked during condition
      * waits, so the main thread can insert alarms.
      */
-    status = pthread_mutex_lock (&alarm_mutex);
+    status = pthread_mutex_lock (&shard->mutex);
     if (status != 0)
         err_abort (status, "Lock mutex");
     while (1) {
         /*
-         * If the alarm list is empty, wait until an alarm is
-         * added. Setting current_alarm to 0 informs the insert
-         * routine that the thread is not busy.
+         * Apply a batch of the commands that have arrived, fire
+         * what is due, then (unless there is more to apply) wait
+         * until the next tick with work, or until the store or the
+         * inbox gets something.
+         */
+        backlog = command_drain (shard);
+        next = alarm_expire (shard);
+        if (backlog || shard->output_used > 0) {
+            /*
+             * Give the mutex up to print what the batch reported,
+             * and between batches, so View_Alarms is not shut out
+             * for the whole backlog. Then go round again, since
+             * more may have arrived meanwhile.
+             */
+            pthread_mutex_unlock (&shard->mutex);
+            shard_flush (shard);
+            status = pthread_mutex_lock (&shard->mutex);
+            if (status != 0)
+                err_abort (status, "Lock mutex");
+            continue;
+        }
+
+        /*
+         * Say we are about to sleep before the last look at the
+         * inbox; see command_submit.
          */
-        current_alarm = 0;
-        while (alarm_list == NULL) {
-            status = pthread_cond_wait (&alarm_cond, &alarm_mutex);
+        __atomic_store_n (&shard->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&shard->inbox, __ATOMIC_SEQ_CST) != NULL) {
+            /* Something came in after all */
+        } else if (next < 0) {
+            status = pthread_cond_wait (&shard->cond, &shard->mutex);
             if (status != 0)
                 err_abort (status, "Wait on cond");
-            }
-        alarm = alarm_list;
-        alarm_list = alarm->link;
-        now = time (NULL);
-        expired = 0;
-        if (alarm->time > now) {
-#ifdef DEBUG
-            printf ("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-                alarm->time - time (NULL), alarm->message);
-#endif
-            cond_time.tv_sec = alarm->time;
-            cond_time.tv_nsec = 0;
-            current_alarm = alarm->time;
-            while (current_alarm == alarm->time) {
-                status = pthread_cond_timedwait (
-                    &alarm_cond, &alarm_mutex, &cond_time);
-                if (status == ETIMEDOUT) {
-                    expired = 1;
-                    break;
-                }
-                if (status != 0)
-                    err_abort (status, "Cond timedwait");
-            }
-            if (!expired)
-                alarm_insert (alarm);
-        } else
-            expired = 1;
-        if (expired) {
-            printf ("(%d) %s\n", alarm->seconds, alarm->message);
-            free (alarm);
+        } else {
+            cond_time.tv_sec = next / TICKS_PER_SEC;
+            cond_time.tv_nsec = next % TICKS_PER_SEC;
+            status = pthread_cond_timedwait (
+                &shard->cond, &shard->mutex, &cond_time);
+            if (status != 0 && status != ETIMEDOUT)
+                err_abort (status, "Cond timedwait");
         }
+        __atomic_store_n (&shard->sleeping, 0, __ATOMIC_RELAXED);
     }
 }
+#endif
 
 
 void *display_alarm_thread(void *arg) {
-   int group_id = *((int *)arg);  // Extract the group_id from the argument
+    worker_t *worker = (worker_t *)arg;  // The pool slot this thread serves
+    fired_t *fired;
 
     while (1) {
-        pthread_mutex_lock(&alarm_mutex);  // Lock the mutex before accessing the alarm list
-        
-        alarm_t *current = alarm_list;  // Pointer to traverse the alarm list
-        
-        // Traverse through the linked list of alarms
-        while (current != NULL) {
-            // If the alarm belongs to the specified group and the time has arrived, display it
-            if (current->groupId == group_id && time(NULL) >= current->time) {
-                // Print the alarm message
-                char time_buffer[64];
-                get_current_time(time_buffer, sizeof(time_buffer));
-                printf("Alarm(%d) Printed by Display Alarm Thread %ld at %s: Group(%d) %d %s\n",
-                       current->id, pthread_self(), time_buffer, current->groupId,
-                       current->seconds, current->message);
-                
-                // Update the alarm time to trigger again after the specified seconds
-                current->time = time(NULL) + current->seconds;
-            }
-            
-            current = current->link;  // Move to the next alarm in the list
+        // Own deque first, then steal from the others
+        fired = worker_pop(worker);
+        if (!fired && !ordered) {
+            __atomic_store_n(&worker->idle, 1, __ATOMIC_SEQ_CST);
+            fired = worker_steal(worker);
+            if (fired)
+                __atomic_store_n(&worker->idle, 0, __ATOMIC_SEQ_CST);
+        }
+
+        if (!fired) {
+            // Sleep until an alarm is pushed here or a backlog elsewhere kicks us
+            pthread_mutex_lock(&worker->mutex);
+            while (worker->count == 0 && !worker->kicked)
+                pthread_cond_wait(&worker->ready, &worker->mutex);
+            worker->kicked = 0;
+            __atomic_store_n(&worker->idle, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&worker->mutex);
+            continue;
         }
-        
-        pthread_mutex_unlock(&alarm_mutex);  // Unlock the mutex after accessing the list
-        
-        sleep(1);  // Sleep for 1 second before checking again
+
+        // Print the alarm message
+        char time_buffer[64], period_buffer[32], missed_buffer[48] = "";
+        get_current_time(time_buffer, sizeof(time_buffer));
+        if (fired->skipped > 0)
+            snprintf(missed_buffer, sizeof(missed_buffer), " (%lld Missed Periods Skipped)", fired->skipped);
+        printf("Alarm(%d) Printed by Display Alarm Thread %ld at %s: Group(%d) %s %s%s\n",
+               fired->id, pthread_self(), time_buffer, fired->groupId,
+               format_duration(fired->period, period_buffer, sizeof(period_buffer)), fired->message,
+               missed_buffer);
+        pool_free(fired);
     }
     return NULL;  // End the thread function
 }
 void *group_display_creation_thread(void *arg) {
     while (1) {
-        pthread_mutex_lock(&alarm_mutex); // Lock the mutex to access the alarm list
-
-        // Wait until the alarm list is updated
-        pthread_cond_wait(&alarm_cond, &alarm_mutex);
-
-        alarm_t *current = alarm_list; // Pointer to traverse the alarm list
-
-        while (current != NULL) {
-            int group_id = current->groupId;
-
-            // If there is no active thread for this group, create one
-            if (active_group_threads[group_id] == 0) {
-                int *group_id_ptr = malloc(sizeof(int));
-                if (!group_id_ptr) {
-                    fprintf(stderr, "Error: Memory allocation failed\n");
-                    pthread_mutex_unlock(&alarm_mutex);
-                    exit(1);
-                }
-                *group_id_ptr = group_id;
-
-                pthread_t thread;
-                if (pthread_create(&thread, NULL, display_alarm_thread, (void *)group_id_ptr) != 0) {
-                    fprintf(stderr, "Error: Unable to create display alarm thread for group %d\n", group_id);
-                    free(group_id_ptr);
-                    pthread_mutex_unlock(&alarm_mutex);
-                    exit(1);
-                }
-
-                pthread_detach(thread); // Detach the thread so it doesn't need to be joined
-                active_group_threads[group_id] = 1;
-
-                // Log the creation of a new thread
-                char time_buffer[64];
-                get_current_time(time_buffer, sizeof(time_buffer));
-                printf("Alarm Group Display Creation Thread Created New Display Alarm Thread %ld "
-                       "For Alarm(%d) at %s: Group(%d) %d %s\n",
-                       thread, current->id, time_buffer, group_id, current->seconds, current->message);
-            } else {
-                // Log the assignment of an alarm to an existing thread
-                char time_buffer[64];
-                get_current_time(time_buffer, sizeof(time_buffer));
-                printf("Alarm Group Display Creation Thread Assigned Display Alarm Thread For Alarm(%d) "
-                       "at %s: Group(%d) %d %s\n",
-                       current->id, time_buffer, group_id, current->seconds, current->message);
-            }
+        // Wait until an alarm joins a group; group_apply has already given the group its worker
+        group_event_t event;
+        pthread_mutex_lock(&group_mutex);
+        channel_wait(&creation_channel, &event);
+        pthread_mutex_unlock(&group_mutex);
 
-            current = current->link; // Move to the next alarm
+        // Log the assignment without holding the mutex
+        char time_buffer[64], period_buffer[32];
+        get_current_time(time_buffer, sizeof(time_buffer));
+        if (event.assigned) {
+            printf("Alarm Group Display Creation Thread Assigned Display Alarm Thread %ld To New Group "
+                   "For Alarm(%d) at %s: Group(%d) %s %s\n",
+                   event.worker->thread, event.alarmId, time_buffer, event.groupId,
+                   format_duration(event.period, period_buffer, sizeof(period_buffer)), event.message);
+        } else {
+            printf("Alarm Group Display Creation Thread Assigned Display Alarm Thread For Alarm(%d) "
+                   "at %s: Group(%d) %s %s\n",
+                   event.alarmId, time_buffer, event.groupId,
+                   format_duration(event.period, period_buffer, sizeof(period_buffer)), event.message);
         }
-
-        pthread_mutex_unlock(&alarm_mutex); // Unlock the mutex after processing the list
+        pool_free(event.message);
     }
     return NULL;
 }
 void *group_display_removal_thread(void *arg) {
     while (1) {
-        pthread_mutex_lock(&alarm_mutex); // Lock the mutex to access the alarm list
-
-        // Wait until the alarm list is updated
-        pthread_cond_wait(&alarm_cond, &alarm_mutex);
+        pthread_mutex_lock(&group_mutex); // Lock the mutex to access the groups
 
-        // Array to track groups for which we have active threads but no alarms
-        int groups_to_remove[MAX_GROUPS] = {0};
+        // Wait until a group loses its last active alarm
+        group_event_t event;
+        channel_wait(&removal_channel, &event);
+        int group_id = event.groupId;
 
-        // Check the alarm list for active groups
-        alarm_t *current = alarm_list;
-        while (current != NULL) {
-            groups_to_remove[current->groupId] = 1; // Mark group as having an alarm
-            current = current->link;               // Move to the next alarm
+        // The group's count says whether it is still empty; it may have gained an alarm since
+        group_t *group = group_find(&group_registry, group_id);
+        worker_t *worker = NULL;
+        if (group != NULL && group->alarms == 0) {
+            // Release the group's display worker for other groups
+            worker = group->worker;
+            worker->groups--;
+            group_drop(&group_registry, group);
         }
+        pthread_mutex_unlock(&group_mutex); // Unlock the mutex before logging
 
-        // Iterate over all possible groups and find threads to terminate
-        for (int group_id = 0; group_id < MAX_GROUPS; group_id++) {
-            if (active_group_threads[group_id] == 1 && groups_to_remove[group_id] == 0) {
-                // Mark the thread as inactive
-                active_group_threads[group_id] = 0;
-
-                // Log the removal of the display thread
-                char time_buffer[64];
-                get_current_time(time_buffer, sizeof(time_buffer));
-                printf("No More Alarms in Group(%d). Alarm Removal Thread Has Removed "
-                       "Display Alarm Thread at %s: Group(%d)\n",
-                       group_id, time_buffer, group_id);
-            }
+        if (worker != NULL) {
+            // Log the removal of the group from its display worker
+            char time_buffer[64];
+            get_current_time(time_buffer, sizeof(time_buffer));
+            printf("No More Alarms in Group(%d). Alarm Removal Thread Has Removed "
+                   "Display Alarm Thread %ld at %s: Group(%d)\n",
+                   group_id, worker->thread, time_buffer, group_id);
         }
-
-        pthread_mutex_unlock(&alarm_mutex); // Unlock the mutex
     }
     return NULL;
 }
 
 
 
-int main (int argc, char *argv[])
-{
-    int status;
-    char input[128];
-    alarm_t *alarm;
-    pthread_t thread;
-    char command[50];
-    int alarm_id, group_id, time;
-    char message[128 - 50];
+/*
+ * Package a parsed request and send it to its alarm's shard. Only
+ * the thread reading input calls this, as it owns the command pool.
+ */
+void submit_command(int type, int alarm_id, int group_id, long long period, const char *message) {
+    size_t length = strlen(message);
+    command_t *command = (command_t*)pool_alloc(&command_pool, sizeof(command_t) + length + 1);
 
-    pthread_t group_creation_thread, group_removal_thread;
+    command->type = type;
+    command->id = alarm_id;
+    command->groupId = group_id;
+    command->period = period;
+    command->source = pthread_self();
+    memcpy(command->message, message, length + 1);
+    command_submit(command);
+}
 
-    //Create the group display creation thread.
-    if (pthread_create(&group_creation_thread, NULL, group_display_creation_thread, NULL) != 0) {
-        fprintf(stderr, "Error: Unable to create group display creation thread\n");
-        exit(1);
-    }
-    pthread_detach(group_creation_thread);
+/*
+ * The message of a request is the rest of its line, from the
+ * offset where sscanf's %n left off; it is cut off at the newline
+ * in place, so it can be as long as the line without being copied.
+ * Returns NULL if there is no message, or if the duration before it
+ * was too long for its %31s field: sscanf then stops in the middle
+ * of the token, with no whitespace before the offset, and the rest
+ * of the token would be taken for the message.
+ */
+char *message_at (char *input, int offset)
+{
+    char *message;
 
-    // Create the group display removal thread
-    if (pthread_create(&group_removal_thread, NULL, group_display_removal_thread, NULL) != 0) {
-        fprintf(stderr, "Error: Unable to create group display removal thread\n");
-        exit(1);
-    }
-    pthread_detach(group_removal_thread);
-    
+    if (offset <= 0 || !isspace ((unsigned char)input[offset - 1]))
+        return NULL;
+    message = input + offset;
+    message[strcspn (message, "\n")] = '\0';
+    return *message != '\0' ? message : NULL;
+}
 
-    while (1) {
-        printf ("Alarm> ");
-        if (fgets (input, sizeof (input), stdin) == NULL) exit (0);
-        if (strlen (input) <= 1) continue;
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
-        if (alarm == NULL)
-            errno_abort ("Allocate alarm");
+/*
+ * Parse one line of input and hand it on.
+ */
+void process_command (char *input)
+{
+    int alarm_id, group_id, offset = -1;
+    long long period;
+    char duration[32];
+    char *message;
 
-        /*
-         * Parsing input line to check what kind of request is being made.
-         */
-        if (sscanf(input, "Start_Alarm(%d): Group(%d) %d %[^\n]", &alarm_id, &group_id, &time, message) == 4) {
-        if (alarm_id < 0 || group_id < 0 || time < 0) {
+    if (strlen (input) <= 1) return;
+
+    /*
+     * Parsing input line to check what kind of request is being made.
+     */
+    if (sscanf(input, "Start_Alarm(%d): Group(%d) %31s %n", &alarm_id, &group_id, duration, &offset) == 3
+            && (message = message_at(input, offset)) != NULL) {
+        period = parse_duration(duration);
+        if (alarm_id < 0 || group_id < 0 || period < 0) {
             handle_invalid_request();
         } else {
             printf("Start Alarm Request:\n");
             printf("  Alarm ID: %d\n", alarm_id);
             printf("  Group ID: %d\n", group_id);
-            printf("  Time: %d seconds\n", time);
+            printf("  Time: %s seconds\n", duration);
             printf("  Message: %s\n", message);
-            insert_alarm(alarm_id, group_id, time, message);
-
-            // Signal the condition variable to notify the group display creation thread
-            pthread_cond_broadcast(&alarm_cond);
+            submit_command(CMD_START, alarm_id, group_id, period, message);
         }
-    } else if (sscanf(input, "Change_Alarm(%d): Group(%d) %d %[^\n]", &alarm_id, &group_id, &time, message) == 4) {
-        if (alarm_id < 0 || group_id < 0 || time < 0) {
+    } else if (sscanf(input, "Change_Alarm(%d): Group(%d) %31s %n", &alarm_id, &group_id, duration, &offset) == 3
+            && (message = message_at(input, offset)) != NULL) {
+        period = parse_duration(duration);
+        if (alarm_id < 0 || group_id < 0 || period < 0) {
             handle_invalid_request();
         } else {
             printf("Change Alarm Request:\n");
             printf("  Alarm ID: %d\n", alarm_id);
             printf("  Group ID: %d\n", group_id);
-            printf("  Time: %d seconds\n", time);
+            printf("  Time: %s seconds\n", duration);
             printf("  Message: %s\n", message);
+            submit_command(CMD_CHANGE, alarm_id, group_id, period, message);
         }
     } else if (sscanf(input, "Cancel_Alarm(%d)", &alarm_id) == 1) {
         if (alarm_id < 0) {
@@ -406,6 +2562,7 @@ int main (int argc, char *argv[])
         } else {
             printf("Cancel Alarm Request:\n");
             printf("  Alarm ID: %d\n", alarm_id);
+            submit_command(CMD_CANCEL, alarm_id, 0, 0, "");
         }
     } else if (sscanf(input, "Suspend_Alarm(%d)", &alarm_id) == 1) {
         if (alarm_id < 0) {
@@ -413,6 +2570,7 @@ int main (int argc, char *argv[])
         } else {
             printf("Suspend Alarm Request:\n");
             printf("  Alarm ID: %d\n", alarm_id);
+            submit_command(CMD_SUSPEND, alarm_id, 0, 0, "");
         }
     } else if (sscanf(input, "Reactivate_Alarm(%d)", &alarm_id) == 1) {
         if (alarm_id < 0) {
@@ -420,11 +2578,268 @@ int main (int argc, char *argv[])
         } else {
             printf("Reactivate Alarm Request:\n");
             printf("  Alarm ID: %d\n", alarm_id);
+            submit_command(CMD_REACTIVATE, alarm_id, 0, 0, "");
         }
     } else if (strcmp(input, "View_Alarms\n") == 0) {
         printf("View Alarms Request\n");
+        view_timer_stats();
+        view_groups();
     } else {
         handle_invalid_request();
     }
+}
+
+#ifdef ENGINE_TIMERFD
+/*
+ * Built with -DENGINE_TIMERFD, the main thread runs the shards'
+ * timers itself instead of starting an alarm thread per shard.
+ * Each shard's timerfd is armed (absolute, on CLOCK_MONOTONIC) for
+ * its earliest deadline, and epoll waits on them together with the
+ * command input and each shard's wake_fd, which command_submit
+ * writes to when it gives that shard's empty inbox a command. The
+ * timers never wait on a condition variable, so they
+ * cannot be woken by, or contend with, the group threads, and all
+ * the sources are one event loop. Only shards that had an event
+ * are visited on each pass.
+ *
+ * Input is read with read() rather than stdio, so that lines
+ * stdio had buffered could not hide behind an idle descriptor.
+ */
+void event_loop (void)
+{
+    struct epoll_event event, events[64];
+    shard_t *shard;
+    struct itimerspec spec;
+    char *input = NULL, *line, *newline, saved;
+    size_t used = 0, size = 0;
+    int epoll_fd, count, polled = 1, input_ready, backlog = 0;
+    long long next;
+    eventfd_t drain;
+    ssize_t bytes;
+    int status;
+
+    epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        errno_abort ("Create epoll");
+    event.events = EPOLLIN;
+    for (int i = 0; i < shard_count; i++) {
+        event.data.ptr = &shards[i];
+        if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, shards[i].timer_fd, &event) < 0)
+            errno_abort ("Add timerfd");
+        if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, shards[i].wake_fd, &event) < 0)
+            errno_abort ("Add eventfd");
+    }
+    event.data.ptr = NULL;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0) {
+        /*
+         * A regular file cannot be polled; it is always readable.
+         */
+        if (errno != EPERM)
+            errno_abort ("Add input");
+        polled = 0;
+    }
+    memset (&spec, 0, sizeof (spec));
+
+    printf ("Alarm> ");
+    fflush (stdout);
+    while (1) {
+        count = epoll_wait (epoll_fd, events, 64, polled && !backlog ? -1 : 0);
+        if (count < 0 && errno != EINTR)
+            errno_abort ("Wait on epoll");
+        input_ready = !polled;
+        for (int i = 0; i < count; i++) {
+            if ((shard = events[i].data.ptr) == NULL) {
+                input_ready = 1;
+                continue;
+            }
+            eventfd_read (shard->wake_fd, &drain);
+            while (read (shard->timer_fd, &drain, sizeof (drain)) > 0)
+                ;
+            shard->pending = 1;
+        }
+
+        /*
+         * Carry out each complete line, as getline would split
+         * them. The buffer grows to hold a line of any length; a
+         * partial line is kept for the next read.
+         */
+        if (input_ready) {
+            if (size - used < 128) {
+                size = size ? size * 2 : 1024;
+                input = realloc (input, size);
+                if (input == NULL)
+                    errno_abort ("Grow input buffer");
+            }
+            bytes = read (STDIN_FILENO, input + used, size - 1 - used);
+            if (bytes < 0 && errno != EINTR && errno != EAGAIN)
+                errno_abort ("Read input");
+            if (bytes == 0)
+                exit (0);
+            if (bytes > 0)
+                used += bytes;
+            input[used] = '\0';
+            line = input;
+            while ((newline = strchr (line, '\n')) != NULL) {
+                saved = newline[1];
+                newline[1] = '\0';
+                process_command (line);
+                newline[1] = saved;
+                line = newline + 1;
+                printf ("Alarm> ");
+            }
+            used -= line - input;
+            memmove (input, line, used + 1);
+            fflush (stdout);
+        }
+
+        /*
+         * Apply a batch of commands for, and fire what is due in,
+         * each shard that had an event (a shard with more commands
+         * left stays pending), and re-arm its timerfd for what is
+         * next; an all-zero it_value disarms it.
+         */
+        backlog = 0;
+        for (int i = 0; i < shard_count; i++) {
+            shard = &shards[i];
+            if (!shard->pending)
+                continue;
+            status = pthread_mutex_lock (&shard->mutex);
+            if (status != 0)
+                err_abort (status, "Lock mutex");
+            shard->pending = command_drain (shard);
+            backlog |= shard->pending;
+            next = alarm_expire (shard);
+            spec.it_value.tv_sec = next < 0 ? 0 : next / TICKS_PER_SEC;
+            spec.it_value.tv_nsec = next < 0 ? 0 : next % TICKS_PER_SEC;
+            if (timerfd_settime (shard->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+                errno_abort ("Arm timerfd");
+            status = pthread_mutex_unlock (&shard->mutex);
+            if (status != 0)
+                err_abort (status, "Unlock mutex");
+            shard_flush (shard);
+        }
+    }
+}
+#endif
+
+int main (int argc, char *argv[])
+{
+    int status, opt;
+#ifndef ENGINE_TIMERFD
+    char *input = NULL;
+    size_t input_size = 0;
+    pthread_condattr_t cond_attr;
+#endif
+
+    pthread_t group_creation_thread, group_removal_thread;
+
+    worker_count = shard_count = sysconf (_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt (argc, argv, "b:op:s:w:")) != -1) {
+        if (opt == 'b' && atoi (optarg) > 0)
+            batch_size = atoi (optarg);
+        else if (opt == 'o')
+            ordered = 1;
+        else if (opt == 'p' && atoi (optarg) > 0)
+            shard_count = atoi (optarg);
+        else if (opt == 's' && parse_duration (optarg) > 0)
+            timer_slack = parse_duration (optarg);
+        else if (opt == 'w' && atoi (optarg) > 0)
+            worker_count = atoi (optarg);
+        else {
+            fprintf (stderr, "Usage: %s [-b batch_size] [-o] [-p shards] [-s slack] [-w display_workers]\n", argv[0]);
+            exit (1);
+        }
+    }
+    if (worker_count < 1)
+        worker_count = 1;
+    if (shard_count < 1)
+        shard_count = 1;
+
+    shards = calloc (shard_count, sizeof (shard_t));
+    if (shards == NULL)
+        errno_abort ("Allocate shards");
+#ifndef ENGINE_TIMERFD
+    /*
+     * Deadlines are CLOCK_MONOTONIC times, so the alarm threads'
+     * timed waits must use that clock too.
+     */
+    status = pthread_condattr_init (&cond_attr);
+    if (status != 0)
+        err_abort (status, "Init cond attr");
+    status = pthread_condattr_setclock (&cond_attr, CLOCK_MONOTONIC);
+    if (status != 0)
+        err_abort (status, "Set cond clock");
+#endif
+    for (int i = 0; i < shard_count; i++) {
+        status = pthread_mutex_init (&shards[i].mutex, NULL);
+        if (status != 0)
+            err_abort (status, "Init mutex");
+        sched_init (&shards[i].sched, current_tick ());
+#ifdef ENGINE_TIMERFD
+        shards[i].timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (shards[i].timer_fd < 0)
+            errno_abort ("Create timerfd");
+        shards[i].wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shards[i].wake_fd < 0)
+            errno_abort ("Create eventfd");
+#else
+        status = pthread_cond_init (&shards[i].cond, &cond_attr);
+        if (status != 0)
+            err_abort (status, "Init cond");
+#endif
+    }
+#ifndef ENGINE_TIMERFD
+    pthread_condattr_destroy (&cond_attr);
+#endif
+
+    // Start the pool of display alarm threads
+    workers = calloc (worker_count, sizeof (worker_t));
+    if (workers == NULL)
+        errno_abort ("Allocate display workers");
+    for (int i = 0; i < worker_count; i++) {
+        status = pthread_mutex_init (&workers[i].mutex, NULL);
+        if (status != 0)
+            err_abort (status, "Init mutex");
+        status = pthread_cond_init (&workers[i].ready, NULL);
+        if (status != 0)
+            err_abort (status, "Init cond");
+    }
+    for (int i = 0; i < worker_count; i++) {
+        status = pthread_create (&workers[i].thread, NULL,
+            display_alarm_thread, &workers[i]);
+        if (status != 0)
+            err_abort (status, "Create display alarm thread");
+    }
+#ifndef ENGINE_TIMERFD
+    for (int i = 0; i < shard_count; i++) {
+        status = pthread_create (&shards[i].thread, NULL,
+            alarm_thread, &shards[i]);
+        if (status != 0)
+            err_abort (status, "Create alarm thread");
+    }
+#endif
+
+    //Create the group display creation thread.
+    if (pthread_create(&group_creation_thread, NULL, group_display_creation_thread, NULL) != 0) {
+        fprintf(stderr, "Error: Unable to create group display creation thread\n");
+        exit(1);
+    }
+    pthread_detach(group_creation_thread);
+
+    // Create the group display removal thread
+    if (pthread_create(&group_removal_thread, NULL, group_display_removal_thread, NULL) != 0) {
+        fprintf(stderr, "Error: Unable to create group display removal thread\n");
+        exit(1);
+    }
+    pthread_detach(group_removal_thread);
+    
+#ifdef ENGINE_TIMERFD
+    event_loop ();
+#else
+    while (1) {
+        printf ("Alarm> ");
+        if (getline (&input, &input_size, stdin) < 0) exit (0);
+        process_command (input);
     }
+#endif
 }